@@ -0,0 +1,155 @@
+#include "../src/mpris_server.hpp"
+#include "private_bus.hpp"
+#include "stats.hpp"
+#include "count_new.hpp"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// Benchmarks a Server running on a private session bus. A dbus-daemon is
+// started on a socket in a temporary directory, so nothing on the user's
+// session bus is touched. Every result is printed as one JSON object per
+// line.
+
+using Clock = std::chrono::steady_clock;
+
+static void report_op(const char *name, Clock::duration elapsed, uint64_t allocs, std::size_t ops)
+{
+    auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    printf("{\"bench\":\"%s\",\"ops\":%zu,\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f}\n",
+           name, ops, ns / ops, double(allocs) / ops);
+}
+
+static void report_latency(const char *name, int clients, std::vector<double> &us)
+{
+    auto p = percentiles(us);
+    printf("{\"bench\":\"%s\",\"clients\":%d,\"samples\":%zu,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+           name, clients, us.size(), p.p50, p.p90, p.p99, p.max);
+}
+
+static void report_throughput(const char *name, std::size_t sent, std::size_t received, Clock::duration elapsed)
+{
+    auto s = std::chrono::duration<double>(elapsed).count();
+    printf("{\"bench\":\"%s\",\"sent\":%zu,\"received\":%zu,\"per_second\":%.0f}\n", name, sent, received, received / s);
+}
+
+template <typename F>
+static void bench_op(const char *name, std::size_t ops, F &&f)
+{
+    for (std::size_t i = 0; i < ops / 10; i++)
+        f(i);
+    auto a = allocations.load();
+    auto t = Clock::now();
+    for (std::size_t i = 0; i < ops; i++)
+        f(i);
+    auto elapsed = Clock::now() - t;
+    report_op(name, elapsed, allocations.load() - a, ops);
+}
+
+static void bench_setters(mpris::Server &server)
+{
+    const std::size_t n = 20'000;
+    bench_op("setter.set_volume", n, [&] (std::size_t i) { server.set_volume(i & 1 ? 0.5 : 1.0); });
+    bench_op("setter.set_rate",   n, [&] (std::size_t i) { server.set_rate(i & 1 ? 0.5 : 1.0); });
+    bench_op("setter.set_playback_status", n, [&] (std::size_t i) {
+        server.set_playback_status(i & 1 ? mpris::PlaybackStatus::Playing : mpris::PlaybackStatus::Paused);
+    });
+    bench_op("setter.set_identity", n, [&] (std::size_t i) { server.set_identity(i & 1 ? "player a" : "player b"); });
+    bench_op("setter.set_metadata_field", n, [&] (std::size_t i) {
+        server.set_metadata_field(mpris::Field::UseCount, sdbus::Variant(int32_t(i)));
+    });
+    bench_op("setter.set_metadata", n, [&] (std::size_t i) {
+        server.set_metadata({
+            { mpris::Field::TrackId, sdbus::Variant(sdbus::ObjectPath("/track/" + std::to_string(i))) },
+            { mpris::Field::Title,   sdbus::Variant(std::string("a title")) },
+            { mpris::Field::Artist,  sdbus::Variant(mpris::StringList{"an artist"}) },
+            { mpris::Field::Length,  sdbus::Variant(int64_t(180'000'000)) },
+        });
+    });
+    bench_op("setter.set_metadata_typed", n, [&] (std::size_t i) {
+        server.set_metadata(mpris::TrackMetadata()
+            .set<mpris::Field::TrackId>(sdbus::ObjectPath("/track/" + std::to_string(i)))
+            .set<mpris::Field::Title  >("a title")
+            .set<mpris::Field::Artist >({ "an artist" })
+            .set<mpris::Field::Length >(180'000'000));
+    });
+    bench_op("setter.batch_5", n, [&] (std::size_t i) {
+        auto u = server.update();
+        server.set_volume(i & 1 ? 0.5 : 1.0);
+        server.set_rate(i & 1 ? 0.5 : 1.0);
+        server.set_shuffle(i & 1);
+        server.set_loop_status(i & 1 ? mpris::LoopStatus::Track : mpris::LoopStatus::None);
+        server.set_playback_status(i & 1 ? mpris::PlaybackStatus::Playing : mpris::PlaybackStatus::Paused);
+    });
+    bench_op("signal.seeked", n, [&] (std::size_t i) { server.send_seeked_signal(int64_t(i)); });
+}
+
+static void bench_get(const std::string &service, int clients, const char *name, auto &&call)
+{
+    auto us = sample_latency(service, clients, 2'000, call);
+    report_latency(name, clients, us);
+}
+
+static void bench_signals(mpris::Server &server, const std::string &service)
+{
+    const std::size_t n = 50'000;
+    std::atomic<std::size_t> seeked = 0, changed = 0;
+    auto conn  = sdbus::createSessionBusConnection();
+    auto proxy = sdbus::createProxy(*conn, sdbus::ServiceName{service}, sdbus::ObjectPath{mpris::OBJECT_PATH});
+    proxy->uponSignal("Seeked").onInterface(mpris::MP2P).call([&] (int64_t) { seeked++; });
+    proxy->uponSignal("PropertiesChanged").onInterface(mpris::PROPS)
+        .call([&] (const std::string &, const std::map<std::string, sdbus::Variant> &, const std::vector<std::string> &) { changed++; });
+    conn->enterEventLoopAsync();
+
+    auto wait_for = [] (std::atomic<std::size_t> &counter, std::size_t target) {
+        auto deadline = Clock::now() + std::chrono::seconds(10);
+        while (counter < target && Clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    };
+
+    auto t = Clock::now();
+    for (std::size_t i = 0; i < n; i++)
+        server.send_seeked_signal(int64_t(i));
+    wait_for(seeked, n);
+    report_throughput("throughput.seeked", n, seeked, Clock::now() - t);
+
+    t = Clock::now();
+    for (std::size_t i = 0; i < n; i++)
+        server.set_volume(i & 1 ? 0.5 : 1.0);
+    wait_for(changed, n);
+    report_throughput("throughput.properties_changed", n, changed, Clock::now() - t);
+
+    conn->leaveEventLoop();
+}
+
+int main()
+{
+    Bus bus;
+    auto server = mpris::Server::make("bench");
+    if (!server) {
+        fprintf(stderr, "can't create server\n");
+        return 1;
+    }
+    const auto service = mpris::PREFIX + "bench";
+
+    server->set_identity("benchmark player");
+    server->set_minimum_rate(0.5);
+    server->set_metadata({
+        { mpris::Field::TrackId, sdbus::Variant(sdbus::ObjectPath("/track/1")) },
+        { mpris::Field::Title,   sdbus::Variant(std::string("a title")) },
+        { mpris::Field::Artist,  sdbus::Variant(mpris::StringList{"an artist"}) },
+        { mpris::Field::AsText,  sdbus::Variant(std::string(8192, 'x')) },
+    });
+    server->on_play_pause([] { });
+    server->start_loop_async();
+
+    bench_setters(*server);
+    for (int clients : { 1, 4, 16 }) {
+        bench_get(service, clients, "latency.get_playback_status", [] (sdbus::IProxy &p) { p.getProperty("PlaybackStatus").onInterface(mpris::MP2P); });
+        bench_get(service, clients, "latency.get_metadata",        [] (sdbus::IProxy &p) { p.getProperty("Metadata").onInterface(mpris::MP2P); });
+        bench_get(service, clients, "latency.get_all_player",      [] (sdbus::IProxy &p) { p.getAllProperties().onInterface(mpris::MP2P); });
+        bench_get(service, clients, "latency.get_all_root",        [] (sdbus::IProxy &p) { p.getAllProperties().onInterface(mpris::MP2); });
+    }
+    bench_signals(*server, service);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global operator new with one counting its calls, so include
+// it from the program's only source file. Buffers allocated by sd-bus itself
+// are not counted. Not for sanitizer builds, which replace operator new
+// themselves.
+
+static std::atomic<uint64_t> allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept              { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
@@ -0,0 +1,164 @@
+#include "../src/mpris_server.hpp"
+#include "private_bus.hpp"
+#include "stats.hpp"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+// Measures GetAll latency on the MediaPlayer2 and MediaPlayer2.Player
+// interfaces of a player with long lists and metadata, idle and while the
+// metadata changes a thousand times per second. The Server, which serves
+// cached snapshots, is compared with a player built as the Server used to
+// be: getters returning a copy of every string, list and metadata map, here
+// taken under a mutex so that the writer doesn't race with them. Every
+// result is printed as one JSON object per line.
+
+// The same properties as the Server, served by copying.
+class CopyingPlayer {
+    std::unique_ptr<sdbus::IConnection> connection;
+    std::unique_ptr<sdbus::IObject> object;
+    std::mutex mutex;
+    std::string identity, desktop_entry;
+    mpris::StringList supported_uri_schemes, supported_mime_types;
+    mpris::Metadata metadata;
+
+    template <typename T>
+    T copy(const T &value)
+    {
+        std::lock_guard lock(mutex);
+        return value;
+    }
+
+public:
+    CopyingPlayer(const std::string &name, std::string identity, std::string desktop_entry,
+                  mpris::StringList schemes, mpris::StringList mime_types)
+        : connection(sdbus::createSessionBusConnection(sdbus::ServiceName{mpris::PREFIX + name})),
+          identity(std::move(identity)), desktop_entry(std::move(desktop_entry)),
+          supported_uri_schemes(std::move(schemes)), supported_mime_types(std::move(mime_types))
+    {
+        object = sdbus::createObject(*connection, sdbus::ObjectPath{mpris::OBJECT_PATH});
+        object->addVTable(sdbus::registerProperty("CanQuit")            .withGetter([] { return false; })
+                        , sdbus::registerProperty("Fullscreen")         .withGetter([] { return false; })
+                        , sdbus::registerProperty("CanSetFullscreen")   .withGetter([] { return false; })
+                        , sdbus::registerProperty("CanRaise")           .withGetter([] { return false; })
+                        , sdbus::registerProperty("HasTrackList")       .withGetter([] { return false; })
+                        , sdbus::registerProperty("Identity")           .withGetter([this] { return copy(this->identity); })
+                        , sdbus::registerProperty("DesktopEntry")       .withGetter([this] { return copy(this->desktop_entry); })
+                        , sdbus::registerProperty("SupportedUriSchemes").withGetter([this] { return copy(supported_uri_schemes); })
+                        , sdbus::registerProperty("SupportedMimeTypes") .withGetter([this] { return copy(supported_mime_types); })
+                        ).forInterface(mpris::MP2);
+        object->addVTable(sdbus::registerProperty("PlaybackStatus").withGetter([] { return std::string("Stopped"); })
+                        , sdbus::registerProperty("LoopStatus")    .withGetter([] { return std::string("None"); })
+                        , sdbus::registerProperty("Rate")          .withGetter([] { return 1.0; })
+                        , sdbus::registerProperty("Shuffle")       .withGetter([] { return false; })
+                        , sdbus::registerProperty("Metadata")      .withGetter([this] { return copy(metadata); })
+                        , sdbus::registerProperty("Volume")        .withGetter([] { return 0.0; })
+                        , sdbus::registerProperty("Position")      .withGetter([] { return int64_t(0); })
+                        , sdbus::registerProperty("MinimumRate")   .withGetter([] { return 1.0; })
+                        , sdbus::registerProperty("MaximumRate")   .withGetter([] { return 1.0; })
+                        , sdbus::registerProperty("CanGoNext")     .withGetter([] { return true; })
+                        , sdbus::registerProperty("CanGoPrevious") .withGetter([] { return true; })
+                        , sdbus::registerProperty("CanPlay")       .withGetter([] { return true; })
+                        , sdbus::registerProperty("CanPause")      .withGetter([] { return true; })
+                        , sdbus::registerProperty("CanSeek")       .withGetter([] { return false; })
+                        , sdbus::registerProperty("CanControl")    .withGetter([] { return true; })
+                        ).forInterface(mpris::MP2P);
+        connection->enterEventLoopAsync();
+    }
+
+    ~CopyingPlayer() { connection->leaveEventLoop(); }
+
+    void set_metadata(mpris::Metadata value)
+    {
+        std::lock_guard lock(mutex);
+        metadata = std::move(value);
+    }
+};
+
+static void bench_get_all(const char *props, const std::string &service, const std::string &interface, int clients, const char *load)
+{
+    auto us = sample_latency(service, clients, 2'000, [&] (sdbus::IProxy &p) { p.getAllProperties().onInterface(interface); });
+    auto p = percentiles(us);
+    printf("{\"bench\":\"get_all\",\"props\":\"%s\",\"interface\":\"%s\",\"load\":\"%s\",\"clients\":%d,"
+           "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f}\n",
+           props, interface.c_str(), load, clients, p.p50, p.p90, p.p99);
+}
+
+int main()
+{
+    Bus bus;
+    auto server = mpris::Server::make("getall");
+    if (!server) {
+        fprintf(stderr, "can't create server\n");
+        return 1;
+    }
+
+    mpris::StringList mime_types, schemes;
+    for (int i = 0; i < 200; i++)
+        mime_types.push_back("audio/x-format-" + std::to_string(i));
+    for (auto s : { "file", "http", "https", "smb", "sftp", "cdda" })
+        schemes.push_back(s);
+    server->set_identity("getall benchmark player");
+    server->set_desktop_entry("getall-benchmark");
+    server->set_supported_mime_types(mime_types);
+    server->set_supported_uri_schemes(schemes);
+    auto track = [] (int i) {
+        return std::map<mpris::Field, sdbus::Variant>{
+            { mpris::Field::TrackId, sdbus::Variant(sdbus::ObjectPath("/track/" + std::to_string(i))) },
+            { mpris::Field::Title,   sdbus::Variant(std::string("a title")) },
+            { mpris::Field::Artist,  sdbus::Variant(mpris::StringList{ "an artist", "another artist" }) },
+            { mpris::Field::Genre,   sdbus::Variant(mpris::StringList{ "a genre" }) },
+            { mpris::Field::Length,  sdbus::Variant(int64_t(180'000'000)) },
+            { mpris::Field::AsText,  sdbus::Variant(std::string(8192, 'x')) },
+        };
+    };
+    auto track_map = [&] (int i) {
+        mpris::Metadata m;
+        for (const auto &[k, v] : track(i))
+            m.emplace(mpris::detail::field_to_string(k), v);
+        return m;
+    };
+    server->set_metadata(track(0));
+    server->on_play_pause([] { });
+    server->on_play([] { });
+    server->on_pause([] { });
+    server->on_stop([] { });
+    server->on_next([] { });
+    server->on_previous([] { });
+    server->on_loop_status_changed([] (mpris::LoopStatus) { });
+    server->on_shuffle_changed([] (bool) { });
+    server->on_volume_changed([] (double) { });
+    server->start_loop_async();
+
+    CopyingPlayer copying("getall_copying", "getall benchmark player", "getall-benchmark", schemes, mime_types);
+    copying.set_metadata(track_map(0));
+
+    const std::pair<const char *, std::string> players[] = {
+        { "cached",  mpris::PREFIX + "getall" },
+        { "copying", mpris::PREFIX + "getall_copying" },
+    };
+
+    for (const auto &[props, service] : players) {
+        for (int clients : { 1, 4 }) {
+            bench_get_all(props, service, mpris::MP2,  clients, "idle");
+            bench_get_all(props, service, mpris::MP2P, clients, "idle");
+        }
+    }
+
+    for (const auto &[props, service] : players) {
+        std::atomic<bool> done = false;
+        std::thread writer([&] {
+            for (int i = 1; !done; i++) {
+                server->set_metadata(track(i));
+                copying.set_metadata(track_map(i));
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        for (int clients : { 1, 4 })
+            bench_get_all(props, service, mpris::MP2P, clients, "metadata_1khz");
+        done = true;
+        writer.join();
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include "../src/mpris_server.hpp"
+#include "private_bus.hpp"
+#include "stats.hpp"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+// Benchmarks a ServerPool growing from 1 to 100 players on a private session
+// bus: resident memory per player, threads used and Get latency through the
+// single dispatch thread. Every result is printed as one JSON object per
+// line.
+
+using Clock = std::chrono::steady_clock;
+
+static long status_field(const char *name)
+{
+    std::ifstream f("/proc/self/status");
+    std::string line;
+    auto len = std::strlen(name);
+    while (std::getline(f, line))
+        if (line.compare(0, len, name) == 0 && line[len] == ':')
+            return std::strtol(line.c_str() + len + 1, nullptr, 10);
+    return -1;
+}
+
+int main()
+{
+    Bus bus;
+    auto base_rss = status_field("VmRSS");
+    mpris::ServerPool pool;
+    pool.start();
+
+    auto client = sdbus::createSessionBusConnection();
+    std::vector<std::unique_ptr<sdbus::IProxy>> proxies;
+    std::mt19937 rng(42);
+
+    for (int target : { 1, 10, 25, 50, 100 }) {
+        while (static_cast<int>(pool.size()) < target) {
+            auto name = "pool" + std::to_string(pool.size());
+            auto server = pool.add(name, [] (mpris::Server &s) {
+                s.set_identity("pooled player");
+                s.on_play_pause([] { });
+            });
+            if (!server) {
+                fprintf(stderr, "can't add player %s\n", name.c_str());
+                return 1;
+            }
+            proxies.push_back(sdbus::createProxy(*client, sdbus::ServiceName{mpris::PREFIX + name},
+                                                 sdbus::ObjectPath{mpris::OBJECT_PATH}));
+        }
+
+        const int samples = 2'000;
+        std::vector<double> us;
+        us.reserve(samples);
+        for (int i = 0; i < samples; i++) {
+            auto &p = proxies[rng() % proxies.size()];
+            auto t = Clock::now();
+            p->getProperty("PlaybackStatus").onInterface(mpris::MP2P);
+            us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t).count());
+        }
+        auto p = percentiles(us);
+
+        auto rss = status_field("VmRSS");
+        printf("{\"bench\":\"pool\",\"players\":%d,\"threads\":%ld,\"rss_kb\":%ld,\"rss_kb_per_player\":%.1f,"
+               "\"get_p50_us\":%.1f,\"get_p99_us\":%.1f}\n",
+               target, status_field("Threads"), rss, double(rss - base_rss) / target, p.p50, p.p99);
+    }
+    return 0;
+}
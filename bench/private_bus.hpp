@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <string>
+#include <unistd.h>
+
+// A dbus-daemon started on a socket in a temporary directory, so that
+// benchmarks never touch the user's session bus. DBUS_SESSION_BUS_ADDRESS
+// points to it for as long as the object lives.
+struct Bus {
+    std::string dir;
+    pid_t pid = 0;
+
+    Bus()
+    {
+        char tmpl[] = "/tmp/mpris-bench-XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            perror("mkdtemp");
+            std::exit(1);
+        }
+        dir = tmpl;
+        auto address = "unix:path=" + dir + "/bus";
+        auto cmd = "dbus-daemon --session --fork --nopidfile --print-pid=1 --address=" + address;
+        auto f = popen(cmd.c_str(), "r");
+        if (!f || fscanf(f, "%d", &pid) != 1) {
+            fprintf(stderr, "can't start dbus-daemon\n");
+            std::exit(1);
+        }
+        pclose(f);
+        setenv("DBUS_SESSION_BUS_ADDRESS", address.c_str(), 1);
+    }
+
+    ~Bus()
+    {
+        kill(pid, SIGTERM);
+        unlink((dir + "/bus").c_str());
+        rmdir(dir.c_str());
+    }
+};
@@ -0,0 +1,73 @@
+#include "../src/mpris_server.hpp"
+#include "private_bus.hpp"
+#include "stats.hpp"
+#include <chrono>
+#include <future>
+
+// Measures how long creating a Server keeps the caller waiting, on a private
+// session bus: Server::make() against Server::make_async(), for which the
+// time until on_ready is reported too, with the name free and with the name
+// already taken (so that the .instance<pid> fallback is used). Every result
+// is printed as one JSON object per line.
+
+using Clock = std::chrono::steady_clock;
+
+static double us_since(Clock::time_point t)
+{
+    return std::chrono::duration<double, std::micro>(Clock::now() - t).count();
+}
+
+static void report(const char *name, const char *what, std::vector<double> &us)
+{
+    auto p = percentiles(us);
+    printf("{\"bench\":\"%s\",\"measure\":\"%s\",\"samples\":%zu,\"p50_us\":%.1f,\"p90_us\":%.1f,\"max_us\":%.1f}\n",
+           name, what, us.size(), p.p50, p.p90, p.max);
+}
+
+static bool bench_make_async(const char *bench, const std::string &name, int runs)
+{
+    std::vector<double> returned, ready;
+    for (int i = 0; i < runs; i++) {
+        std::promise<mpris::StartResult> promise;
+        auto t = Clock::now();
+        auto server = mpris::Server::make_async(name, [&] (const mpris::StartResult &r) {
+            ready.push_back(us_since(t));
+            promise.set_value(r);
+        });
+        returned.push_back(us_since(t));
+        auto r = promise.get_future().get();
+        if (!r.ok) {
+            fprintf(stderr, "%s: %s\n", bench, r.error.c_str());
+            return false;
+        }
+    }
+    report(bench, "returned", returned);
+    report(bench, "on_ready", ready);
+    return true;
+}
+
+int main()
+{
+    Bus bus;
+    const int runs = 50;
+
+    std::vector<double> made;
+    for (int i = 0; i < runs; i++) {
+        auto t = Clock::now();
+        auto server = mpris::Server::make("startup");
+        made.push_back(us_since(t));
+        if (!server) {
+            fprintf(stderr, "can't create server\n");
+            return 1;
+        }
+    }
+    report("startup.make", "returned", made);
+
+    if (!bench_make_async("startup.make_async", "startup", runs))
+        return 1;
+
+    auto holder = mpris::Server::make("startup");
+    if (!holder || !bench_make_async("startup.make_async_fallback", "startup", runs))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "../src/mpris_server.hpp"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Latency measurement shared by the benchmarks.
+
+struct Percentiles {
+    double p50, p90, p99, max;
+};
+
+// Sorts us, which must not be empty.
+inline Percentiles percentiles(std::vector<double> &us)
+{
+    std::sort(us.begin(), us.end());
+    auto pct = [&] (double p) { return us[std::min(us.size() - 1, std::size_t(p * us.size()))]; };
+    return { pct(0.50), pct(0.90), pct(0.99), us.back() };
+}
+
+// Times call(proxy), in microseconds, made per_client times by each of
+// clients threads, each with a connection and proxy of its own.
+inline std::vector<double> sample_latency(const std::string &service, int clients, int per_client, auto &&call)
+{
+    using Clock = std::chrono::steady_clock;
+    std::vector<std::vector<double>> samples(clients);
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; c++) {
+        threads.emplace_back([&, c] {
+            auto conn  = sdbus::createSessionBusConnection();
+            auto proxy = sdbus::createProxy(*conn, sdbus::ServiceName{service}, sdbus::ObjectPath{mpris::OBJECT_PATH});
+            samples[c].reserve(per_client);
+            for (int i = 0; i < per_client; i++) {
+                auto t = Clock::now();
+                call(*proxy);
+                samples[c].push_back(std::chrono::duration<double, std::micro>(Clock::now() - t).count());
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    std::vector<double> all;
+    for (auto &s : samples)
+        all.insert(all.end(), s.begin(), s.end());
+    return all;
+}
@@ -0,0 +1,83 @@
+#include "../src/mpris_server.hpp"
+#include <chrono>
+#include <random>
+#include <malloc.h>
+
+// Benchmarks the TrackList store with large lists. Every result is printed
+// as one JSON object per line.
+
+using Clock = std::chrono::steady_clock;
+
+static std::string track_id(int i) { return "/org/mpris/MediaPlayer2/Track/" + std::to_string(i); }
+
+static void report(const char *name, std::size_t n, Clock::duration elapsed, std::size_t ops)
+{
+    auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    printf("{\"bench\":\"tracklist.%s\",\"tracks\":%zu,\"ops\":%zu,\"ns_per_op\":%.1f}\n", name, n, ops, ns / ops);
+}
+
+static std::size_t heap_in_use() { return mallinfo2().uordblks; }
+
+// Heap used per track by a list of n tracks from albums of 10 tracks, each
+// with its own title, url and track number.
+static void report_memory(int n)
+{
+    auto before = heap_in_use();
+    mpris::detail::TrackList list;
+    for (int i = 0; i < n; i++) {
+        auto album = std::to_string(i / 10);
+        list.insert(track_id(i), {
+            { mpris::Field::Album,       sdbus::Variant("album " + album) },
+            { mpris::Field::Artist,      sdbus::Variant(mpris::StringList{"artist " + album}) },
+            { mpris::Field::Title,       sdbus::Variant("track number " + std::to_string(i)) },
+            { mpris::Field::Url,         sdbus::Variant("file:///music/" + album + "/" + std::to_string(i) + ".flac") },
+            { mpris::Field::Length,      sdbus::Variant(int64_t(180'000'000)) },
+            { mpris::Field::TrackNumber, sdbus::Variant(int32_t(i % 10 + 1)) },
+        }, mpris::NO_TRACK);
+    }
+    auto bytes = heap_in_use() - before;
+    printf("{\"bench\":\"tracklist.memory\",\"tracks\":%d,\"bytes_per_track\":%.1f}\n", n, double(bytes) / n);
+}
+
+int main()
+{
+    const int n = 100'000;
+    std::mt19937 rng(42);
+    mpris::detail::TrackList list;
+    std::map<mpris::Field, sdbus::Variant> metadata = {
+        { mpris::Field::Album,  sdbus::Variant(std::string("an album")) },
+        { mpris::Field::Artist, sdbus::Variant(mpris::StringList{"an artist"}) },
+        { mpris::Field::Length, sdbus::Variant(int64_t(180'000'000)) },
+    };
+
+    auto t = Clock::now();
+    for (int i = 0; i < n; i++)
+        list.insert(track_id(i), metadata, i == 0 ? mpris::NO_TRACK : track_id(rng() % i));
+    report("insert_random", n, Clock::now() - t, n);
+
+    t = Clock::now();
+    std::size_t found = 0;
+    for (int i = 0; i < n; i++)
+        found += list.find(track_id(rng() % n)) != nullptr;
+    report("find", n, Clock::now() - t, n);
+
+    t = Clock::now();
+    std::size_t count = 0;
+    for (int i = 0; i < 100; i++)
+        list.for_each([&] (const auto &) { count++; });
+    report("for_each", n, Clock::now() - t, 100);
+
+    t = Clock::now();
+    for (int i = 0; i < n / 2; i++)
+        list.erase(track_id(rng() % n));
+    report("erase_random", n, Clock::now() - t, n / 2);
+
+    t = Clock::now();
+    for (int i = n; i < n + n / 2; i++)
+        list.insert(track_id(i), metadata, track_id(rng() % i));
+    report("reinsert_random", list.size(), Clock::now() - t, n / 2);
+
+    report_memory(n);
+
+    return found + count == 0;
+}
@@ -4,7 +4,6 @@
 int main()
 {
     int i = 0;
-    int64_t pos = 0;
     bool playing = false;
 
     auto opt = mpris::Server::make("genericplayer");
@@ -18,13 +17,13 @@ int main()
     server.set_identity("A generic player");
     server.set_supported_uri_schemes({ "file" });
     server.set_supported_mime_types({ "application/octet-stream", "text/plain" });
-    server.set_metadata({
-        { mpris::Field::TrackId, sdbus::Variant("/1"            ) },
-        { mpris::Field::Album,   sdbus::Variant("an album"      ) },
-        { mpris::Field::Title,   sdbus::Variant("best song ever") },
-        { mpris::Field::Artist,  sdbus::Variant("idk"           ) },
-        { mpris::Field::Length,  sdbus::Variant(1000            ) }
-    } );
+    server.set_metadata(mpris::TrackMetadata()
+        .set<mpris::Field::TrackId>(sdbus::ObjectPath("/1"))
+        .set<mpris::Field::Album  >("an album")
+        .set<mpris::Field::Title  >("best song ever")
+        .set<mpris::Field::Artist >({ "idk" })
+        .set<mpris::Field::Length >(1000)
+    );
     server.set_maximum_rate(2.0);
     server.set_minimum_rate(0.1);
 
@@ -48,8 +47,8 @@ int main()
         playing = true;
         server.set_playback_status(mpris::PlaybackStatus::Playing);
     });
-    server.on_seek(        [&] (int64_t p) { pos += p; server.set_position(pos); });
-    server.on_set_position([&] (int64_t p) { pos  = p; server.set_position(pos); });
+    server.on_seek(        [&] (int64_t p) { server.set_position(server.current_position() + p); });
+    server.on_set_position([&] (int64_t p) { server.set_position(p); });
     server.on_open_uri([&] (std::string_view uri) { printf("not opening uri, sorry\n"); });
 
     server.on_loop_status_changed([&] (mpris::LoopStatus status) { });
@@ -60,12 +59,12 @@ int main()
     server.start_loop_async();
 
     // ideally, you'd call your music player here
-    // in this example we will simulate one with this simple loop:
+    // in this example we will simulate one with this simple loop.
+    // the server keeps track of the position by itself while playing, so
+    // set_position() only needs to be called when the position jumps.
     for (;;) {
         if (playing) {
-            printf("%ld\n", pos);
-            pos++;
-            server.set_position(pos);
+            printf("%ld\n", server.current_position());
         } else {
             printf("i'm paused (or stopped)\n");
         }
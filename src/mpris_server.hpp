@@ -1,18 +1,36 @@
 #ifndef MPRIS_SERVER_HPP_INCLUDED
 #define MPRIS_SERVER_HPP_INCLUDED
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <map>
+#include <mutex>
 #include <optional>
+#include <random>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 #include <memory>
 
 #ifndef MPRIS_SERVER_NO_IMPL
 #include <sdbus-c++/sdbus-c++.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #else
 
 namespace sdbus {
@@ -23,12 +41,19 @@ struct Variant {
     Variant(const T &) { }
 };
 
-struct ObjectPath { };
+struct ObjectPath : std::string { using std::string::string; };
+struct Message { };
+template <typename... T> struct Result { };
+template <typename... T> struct Struct { };
 struct IConnection { };
 struct IObject { };
+struct IProxy { };
+using Slot = std::unique_ptr<void, std::function<void(void *)>>;
 
 } // namespace sdbus
 
+struct epoll_event;
+
 #endif
 
 namespace mpris {
@@ -42,10 +67,15 @@ static const auto PREFIX      = "org.mpris.MediaPlayer2."s;
 static const auto OBJECT_PATH = "/org/mpris/MediaPlayer2"s;
 static const auto MP2         = "org.mpris.MediaPlayer2"s;
 static const auto MP2P        = "org.mpris.MediaPlayer2.Player"s;
+static const auto MP2TL       = "org.mpris.MediaPlayer2.TrackList"s;
+static const auto MP2PL       = "org.mpris.MediaPlayer2.Playlists"s;
 static const auto PROPS       = "org.freedesktop.DBus.Properties"s;
+static const auto NO_TRACK    = "/org/mpris/MediaPlayer2/TrackList/NoTrack"s;
+static const auto METRICS     = "io.github.chrg127.MprisServer.Metrics"s;
 
 enum class PlaybackStatus { Playing, Paused, Stopped };
 enum class LoopStatus     { None, Track, Playlist };
+enum class PlaylistOrdering { Alphabetical, CreationDate, ModifiedDate, LastPlayDate, UserDefined };
 
 enum class Field {
     TrackId     , Length     , ArtUrl      , Album          ,
@@ -58,15 +88,161 @@ enum class Field {
 
 static const char *playback_status_strings[] = { "Playing"           , "Paused"              , "Stopped" };
 static const char *loop_status_strings[]     = { "None"              , "Track"               , "Playlist" };
-static const char *metadata_strings[]        = { "mpris:trackid"     , "mpris:length"        , "mpris:artUrl"      , "xesam:album"          ,
-                                                 "xesam:albumArtist" , "xesam:artist"        , "xesam:asText"      , "xesam:audioBPM"       ,
-                                                 "xesam:autoRating"  , "xesam:comment"       , "xesam:composer"    , "xesam:contentCreated" ,
-                                                 "xesam:discNumber"  , "xesam:firstUsed"     , "xesam:genre"       , "xesam:lastUsed"       ,
-                                                 "xesam:lyricist"    , "xesam:title"         , "xesam:trackNumber" , "xesam:url"            ,
-                                                 "xesam:useCount"    , "xesam:userRating" };
+static constexpr const char *playlist_ordering_strings[] = { "Alphabetical", "CreationDate", "ModifiedDate", "LastPlayDate",
+                                                             "UserDefined" };
+static constexpr const char *metadata_strings[] = { "mpris:trackid"     , "mpris:length"        , "mpris:artUrl"      , "xesam:album"          ,
+                                                   "xesam:albumArtist" , "xesam:artist"        , "xesam:asText"      , "xesam:audioBPM"       ,
+                                                   "xesam:autoRating"  , "xesam:comment"       , "xesam:composer"    , "xesam:contentCreated" ,
+                                                   "xesam:discNumber"  , "xesam:firstUsed"     , "xesam:genre"       , "xesam:lastUsed"       ,
+                                                   "xesam:lyricist"    , "xesam:title"         , "xesam:trackNumber" , "xesam:url"            ,
+                                                   "xesam:useCount"    , "xesam:userRating" };
+static constexpr const char *metadata_signatures[] = { "o"              , "x"                   , "s"                 , "s"                    ,
+                                                       "as"             , "as"                  , "s"                 , "i"                    ,
+                                                       "d"              , "as"                  , "as"                , "s"                    ,
+                                                       "i"              , "s"                   , "as"                , "s"                    ,
+                                                       "as"             , "s"                   , "i"                 , "s"                    ,
+                                                       "i"              , "d" };
+
+enum class DispatchMode { Immediate, Queued };
+
+// A method call or property set received from a client, as stored in the
+// command queue when the server is in DispatchMode::Queued.
+struct Command {
+    enum class Type : uint8_t {
+        Quit, Raise, Next, Previous, Pause, PlayPause, Stop, Play,
+        Seek, SetPosition, SetFullscreen, SetLoopStatus, SetRate, SetShuffle, SetVolume
+    };
+
+    Type type              = Type::Quit;
+    LoopStatus loop_status = LoopStatus::None; // SetLoopStatus
+    bool flag              = false;            // SetFullscreen, SetShuffle
+    int64_t position       = 0;                // Seek (offset), SetPosition
+    double value           = 0.0;              // SetRate, SetVolume
+};
+
+// A playlist as returned by the provider set with Server::on_playlist_at().
+// The dates are only used for sorting; any unit works as long as it's
+// consistent.
+struct Playlist {
+    std::string id; // object path
+    std::string name;
+    std::string icon = "";
+    int64_t created     = 0;
+    int64_t modified    = 0;
+    int64_t last_played = 0;
+};
+
+struct MemberMetrics {
+    uint64_t calls = 0;
+    std::chrono::nanoseconds total_time = {};
+    // latency_histogram[i] counts calls that took less than 2^i microseconds
+    // (and not less than 2^(i-1)); the last bucket also counts slower calls.
+    std::array<uint64_t, 20> latency_histogram = {};
+};
+
+// Activity recorded by a Server compiled with MPRIS_SERVER_METRICS. Members
+// are method names, or property names prefixed with "Get." or "Set.".
+struct Metrics {
+    std::map<std::string, MemberMetrics, std::less<>> members;
+    // by unique bus name, for the most recent callers only: past
+    // max_callers, the one seen least recently is dropped
+    std::map<std::string, uint64_t, std::less<>> callers;
+    static constexpr std::size_t max_callers = 256;
+    uint64_t signals_emitted   = 0;
+    uint64_t signals_coalesced = 0;
+};
+
+struct ThrottleStats {
+    uint64_t emitted   = 0; // changes sent to clients
+    uint64_t coalesced = 0; // changes held back and merged into a later signal
+};
+
+// Outcome of Server::make_async(): the bus name acquired, or why none was.
+struct StartResult {
+    bool ok = false;
+    std::string bus_name;
+    std::string error;
+};
+
+// What an external event loop has to watch for a Server: fd for events
+// (POLLIN/POLLOUT), event_fd and wake_fd for POLLIN. Server::process_pending()
+// must be called when any of them is ready, or after timeout_ms (-1: no
+// timeout). wake_fd becomes readable when a throttled change, made from any
+// thread, needs a shorter timeout than the one last returned.
+struct PollData {
+    int fd          = -1;
+    short events    = 0;
+    int event_fd    = -1;
+    int wake_fd     = -1;
+    int timeout_ms  = -1;
+};
 
 namespace detail {
 
+// Properties for which PropertiesChanged is sent. Pending changes are kept as
+// a PropMask and the current values are read when the signal is written.
+enum class Prop : uint8_t {
+    CanQuit, CanRaise, CanSetFullscreen, Fullscreen, HasTrackList, Identity, DesktopEntry, SupportedUriSchemes, SupportedMimeTypes,
+    PlaybackStatus, LoopStatus, Rate, Shuffle, Metadata, Volume, MinimumRate, MaximumRate,
+    CanGoNext, CanGoPrevious, CanPlay, CanPause, CanSeek,
+    CanEditTracks,
+    PlaylistCount, Orderings, ActivePlaylist,
+};
+
+struct PropInfo {
+    uint8_t interface; // index into Server::interfaces
+    const char *name;
+    const char *signature;
+};
+
+inline constexpr PropInfo prop_table[] = {
+    { 0, "CanQuit"            , "b"        }, { 0, "CanRaise"           , "b"        }, { 0, "CanSetFullscreen"   , "b"        },
+    { 0, "Fullscreen"         , "b"        }, { 0, "HasTrackList"       , "b"        }, { 0, "Identity"           , "s"        },
+    { 0, "DesktopEntry"       , "s"        }, { 0, "SupportedUriSchemes", "as"       }, { 0, "SupportedMimeTypes" , "as"       },
+    { 1, "PlaybackStatus"     , "s"        }, { 1, "LoopStatus"         , "s"        }, { 1, "Rate"               , "d"        },
+    { 1, "Shuffle"            , "b"        }, { 1, "Metadata"           , "a{sv}"    }, { 1, "Volume"             , "d"        },
+    { 1, "MinimumRate"        , "d"        }, { 1, "MaximumRate"        , "d"        }, { 1, "CanGoNext"          , "b"        },
+    { 1, "CanGoPrevious"      , "b"        }, { 1, "CanPlay"            , "b"        }, { 1, "CanPause"           , "b"        },
+    { 1, "CanSeek"            , "b"        }, { 2, "CanEditTracks"      , "b"        }, { 3, "PlaylistCount"      , "u"        },
+    { 3, "Orderings"          , "as"       }, { 3, "ActivePlaylist"     , "(b(oss))" },
+};
+
+using PropMask = uint64_t;
+
+static_assert(std::size(prop_table) == static_cast<std::size_t>(Prop::ActivePlaylist) + 1);
+static_assert(std::size(prop_table) <= 64);
+
+constexpr PropMask prop_bit(Prop p) { return PropMask(1) << static_cast<int>(p); }
+
+inline constexpr auto interface_props = [] {
+    std::array<PropMask, 4> r = {};
+    for (std::size_t i = 0; i < std::size(prop_table); i++)
+        r[prop_table[i].interface] |= PropMask(1) << i;
+    return r;
+}();
+
+// Properties whose values are kept in RootProps and PlayerProps.
+inline constexpr PropMask root_view_props = prop_bit(Prop::CanQuit) | prop_bit(Prop::CanRaise) | prop_bit(Prop::CanSetFullscreen)
+    | prop_bit(Prop::HasTrackList) | prop_bit(Prop::Identity) | prop_bit(Prop::DesktopEntry)
+    | prop_bit(Prop::SupportedUriSchemes) | prop_bit(Prop::SupportedMimeTypes);
+inline constexpr PropMask player_view_props = prop_bit(Prop::Metadata) | prop_bit(Prop::CanGoNext) | prop_bit(Prop::CanGoPrevious)
+    | prop_bit(Prop::CanPlay) | prop_bit(Prop::CanPause) | prop_bit(Prop::CanSeek);
+
+inline std::optional<Prop> find_prop(std::string_view name)
+{
+    for (std::size_t i = 0; i < std::size(prop_table); i++)
+        if (prop_table[i].name == name)
+            return static_cast<Prop>(i);
+    return std::nullopt;
+}
+
+struct Throttle {
+    std::chrono::steady_clock::duration interval = {}; // zero when not throttled
+    std::chrono::steady_clock::time_point last = {};
+    bool pending = false;
+    ThrottleStats stats;
+};
+
 template <typename T, typename R, typename... Args>
 std::function<R(Args...)> member_fn(T *obj, R (T::*fn)(Args...))
 {
@@ -79,323 +255,3156 @@ std::function<R(Args...)> member_fn(T *obj, R (T::*fn)(Args...) const)
     return [=](Args&&... args) -> R { return (obj->*fn)(args...); };
 }
 
-inline std::string playback_status_to_string(PlaybackStatus status) { return playback_status_strings[static_cast<int>(status)]; }
-inline std::string loop_status_to_string(        LoopStatus status) { return     loop_status_strings[static_cast<int>(status)]; }
-inline std::string field_to_string(                    Field entry) { return        metadata_strings[static_cast<int>( entry)]; }
+inline const char *playback_status_to_string(PlaybackStatus status) { return playback_status_strings[static_cast<int>(status)]; }
+inline const char *loop_status_to_string(        LoopStatus status) { return     loop_status_strings[static_cast<int>(status)]; }
+inline const char *field_to_string(                    Field entry) { return        metadata_strings[static_cast<int>( entry)]; }
 
-} // namespace detail
+template <typename E, std::size_t N>
+E enum_from_string(const char *(&strings)[N], std::string_view s, E fallback)
+{
+    for (std::size_t i = 0; i < N; i++)
+        if (s == strings[i])
+            return static_cast<E>(i);
+    return fallback;
+}
 
-class Server {
-    std::string service_name;
-    std::unique_ptr<sdbus::IConnection> connection;
-    std::unique_ptr<sdbus::IObject> object;
+using DBusPlaylist = sdbus::Struct<sdbus::ObjectPath, std::string, std::string>;
 
-    std::function<void(void)>               quit_fn;
-    std::function<void(void)>               raise_fn;
-    std::function<void(void)>               next_fn;
-    std::function<void(void)>               previous_fn;
-    std::function<void(void)>               pause_fn;
-    std::function<void(void)>               play_pause_fn;
-    std::function<void(void)>               stop_fn;
-    std::function<void(void)>               play_fn;
-    std::function<void(int64_t)>            seek_fn;
-    std::function<void(int64_t)>            set_position_fn;
-    std::function<void(std::string_view)>   open_uri_fn;
-    std::function<void(bool)>               fullscreen_changed_fn;
-    std::function<void(LoopStatus)>         loop_status_changed_fn;
-    std::function<void(double)>             rate_changed_fn;
-    std::function<void(bool)>               shuffle_changed_fn;
-    std::function<void(double)>             volume_changed_fn;
+struct FieldInfo {
+    Field field;
+    const char *key;
+    const char *signature;
+};
 
-    bool fullscreen                  = false;
-    std::string identity             = "";
-    std::string desktop_entry        = "";
-    StringList supported_uri_schemes = {};
-    StringList supported_mime_types  = {};
-    PlaybackStatus playback_status   = PlaybackStatus::Stopped;
-    LoopStatus loop_status           = LoopStatus::None;
-    double rate                      = 1.0;
-    bool shuffle                     = false;
-    Metadata metadata                = {};
-    double volume                    = 0.0;
-    int64_t position                 = 0;
-    double maximum_rate              = 1.0;
-    double minimum_rate              = 1.0;
-
-    void prop_changed(const std::string &interface, const std::string &name, sdbus::Variant value);
-    void control_props_changed(auto&&... args);
+inline constexpr auto field_table = [] {
+    static_assert(std::size(metadata_strings) == std::size(metadata_signatures));
+    static_assert(std::size(metadata_strings) == static_cast<std::size_t>(Field::UserRating) + 1);
+    std::array<FieldInfo, std::size(metadata_strings)> t = {};
+    for (std::size_t i = 0; i < t.size(); i++)
+        t[i] = { static_cast<Field>(i), metadata_strings[i], metadata_signatures[i] };
+    return t;
+}();
 
-    bool can_control()     const { return bool(loop_status_changed_fn) && bool(shuffle_changed_fn)
-                                       && bool(volume_changed_fn)      && bool(stop_fn);                }
-    bool can_go_next()     const { return can_control() && bool(next_fn);                               }
-    bool can_go_previous() const { return can_control() && bool(previous_fn);                           }
-    bool can_play()        const { return can_control() && bool(play_fn)      && bool(play_pause_fn);   }
-    bool can_pause()       const { return can_control() && bool(pause_fn)     && bool(play_pause_fn);   }
-    bool can_seek()        const { return can_control() && bool(seek_fn)      && bool(set_position_fn); }
+// Value of a TrackMetadata field. sdbus::Variant holds values set through the
+// untyped API, which are sent as they are.
+using FieldValue = std::variant<std::monostate, std::string, sdbus::ObjectPath, int64_t, int32_t, double, StringList, sdbus::Variant>;
 
-    void set_fullscreen_external(bool value);
-    void set_loop_status_external(const std::string &value);
-    void set_rate_external(double value);
-    void set_shuffle_external(bool value);
-    void set_volume_external(double value);
-    void set_position_method(sdbus::ObjectPath id, int64_t pos);
-    void open_uri(const std::string &uri);
+constexpr std::size_t field_value_index(std::string_view signature)
+{
+    return signature == "s"  ? 1
+         : signature == "o"  ? 2
+         : signature == "x"  ? 3
+         : signature == "i"  ? 4
+         : signature == "d"  ? 5
+         : signature == "as" ? 6
+         :                     7;
+}
+
+#ifndef MPRIS_SERVER_NO_IMPL
+
+inline bool variant_equal(const sdbus::Variant &a, const sdbus::Variant &b)
+{
+    if (a.isEmpty() || b.isEmpty())
+        return a.isEmpty() && b.isEmpty();
+    std::string_view type = a.peekValueType();
+    if (type != b.peekValueType())
+        return false;
+    if (type == "s")  return a.get<std::string>()        == b.get<std::string>();
+    if (type == "o")  return a.get<sdbus::ObjectPath>()  == b.get<sdbus::ObjectPath>();
+    if (type == "x")  return a.get<int64_t>()            == b.get<int64_t>();
+    if (type == "t")  return a.get<uint64_t>()           == b.get<uint64_t>();
+    if (type == "i")  return a.get<int32_t>()            == b.get<int32_t>();
+    if (type == "u")  return a.get<uint32_t>()           == b.get<uint32_t>();
+    if (type == "d")  return a.get<double>()             == b.get<double>();
+    if (type == "b")  return a.get<bool>()               == b.get<bool>();
+    if (type == "as") return a.get<StringList>()         == b.get<StringList>();
+    return false;
+}
+
+// Moves v into the typed slot of field f when it has the type the spec
+// requires; otherwise it's kept as a Variant.
+inline FieldValue field_value_from_variant(const FieldInfo &f, const sdbus::Variant &v)
+{
+    if (v.isEmpty() || std::string_view(v.peekValueType()) != f.signature)
+        return v;
+    switch (field_value_index(f.signature)) {
+    case 1:  return v.get<std::string>();
+    case 2:  return v.get<sdbus::ObjectPath>();
+    case 3:  return v.get<int64_t>();
+    case 4:  return v.get<int32_t>();
+    case 5:  return v.get<double>();
+    case 6:  return v.get<StringList>();
+    default: return v;
+    }
+}
+
+// A track's Length in microseconds, whatever integer type it was given
+// with; -1 if unknown.
+inline int64_t track_length(const FieldValue &length)
+{
+    if (auto n = std::get_if<int64_t>(&length))
+        return *n;
+    auto v = std::get_if<sdbus::Variant>(&length);
+    if (!v || v->isEmpty())
+        return -1;
+    std::string_view type = v->peekValueType();
+    if (type == "t") return static_cast<int64_t>(v->get<uint64_t>());
+    if (type == "i") return v->get<int32_t>();
+    if (type == "u") return v->get<uint32_t>();
+    return -1;
+}
+
+#else
+
+inline bool variant_equal(const sdbus::Variant &a, const sdbus::Variant &b) { return false; }
+inline FieldValue field_value_from_variant(const FieldInfo &f, const sdbus::Variant &v) { return v; }
+inline int64_t track_length(const FieldValue &length) { auto n = std::get_if<int64_t>(&length); return n ? *n : -1; }
+
+#endif
+
+inline bool field_value_equal(const FieldValue &a, const FieldValue &b)
+{
+    if (a.index() != b.index())
+        return false;
+    return std::visit([&] <typename T> (const T &x) {
+        if constexpr (std::is_same_v<T, sdbus::Variant>)
+            return variant_equal(x, std::get<T>(b));
+        else
+            return x == std::get<T>(b);
+    }, a);
+}
+
+// Key under which a value is interned by TrackList, if it's worth it.
+inline std::optional<std::string> intern_key(const FieldValue &v)
+{
+    if (auto s = std::get_if<std::string>(&v))
+        return "s" + *s;
+    if (auto l = std::get_if<StringList>(&v)) {
+        auto key = "as"s;
+        for (const auto &s : *l)
+            key += s + '\0';
+        return key;
+    }
+    return std::nullopt;
+}
 
+// An immutable value that writers replace as a whole; readers get a
+// reference-counted snapshot and never wait for writers.
+template <typename T>
+class Snapshot {
+    std::atomic<std::shared_ptr<const T>> ptr;
 public:
-    static std::unique_ptr<Server> make(std::string_view name);
+    explicit Snapshot(T value = {}) : ptr(std::make_shared<const T>(std::move(value))) { }
+    std::shared_ptr<const T> load() const { return ptr.load(std::memory_order_acquire); }
+    void store(T value)                   { ptr.store(std::make_shared<const T>(std::move(value)), std::memory_order_release); }
+};
 
-    explicit Server(std::string_view player_name);
-    void start_loop();
-    void start_loop_async();
+struct PositionAnchor {
+    int64_t position                      = 0;
+    std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+    double rate                           = 1.0;
+    bool playing                          = false;
+    int64_t length                        = -1; // of the current track, -1 if unknown
+
+    // never runs past the end of the track, in case the player is late
+    // reporting it
+    int64_t at(std::chrono::steady_clock::time_point now) const
+    {
+        if (!playing)
+            return position;
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - time);
+        auto p = position + static_cast<int64_t>(static_cast<double>(elapsed.count()) * rate);
+        return length < 0 ? p : std::min(p, std::max(position, length));
+    }
+};
 
-    void on_quit                ( auto &&fn) { quit_fn                = fn; prop_changed(MP2, "CanQuit", sdbus::Variant(true));                                    }
-    void on_raise               ( auto &&fn) { raise_fn               = fn; prop_changed(MP2, "CanQuit", sdbus::Variant(true));                                    }
-    void on_next                ( auto &&fn) { next_fn                = fn; control_props_changed("CanGoNext");                                                    }
-    void on_previous            ( auto &&fn) { previous_fn            = fn; control_props_changed("CanGoPrevious");                                                }
-    void on_pause               ( auto &&fn) { pause_fn               = fn; control_props_changed("CanPause");                                                     }
-    void on_play_pause          ( auto &&fn) { play_pause_fn          = fn; control_props_changed("CanPlay", "CanPause");                                          }
-    void on_stop                ( auto &&fn) { stop_fn                = fn; control_props_changed("CanGoNext", "CanGoPrevious", "CanPause", "CanPlay", "CanSeek"); }
-    void on_play                ( auto &&fn) { play_fn                = fn; control_props_changed("CanPlay");                                                      }
-    void on_seek                ( auto &&fn) { seek_fn                = fn; control_props_changed("CanSeek");                                                      }
-    void on_set_position        ( auto &&fn) { set_position_fn        = fn; control_props_changed("CanSeek");                                                      }
-    void on_open_uri            ( auto &&fn) { open_uri_fn            = fn;                                                                                        }
-    void on_fullscreen_changed  ( auto &&fn) { fullscreen_changed_fn  = fn; prop_changed(MP2, "CanSetFullscreen", sdbus::Variant(true));                           }
-    void on_loop_status_changed ( auto &&fn) { loop_status_changed_fn = fn; control_props_changed("CanGoNext", "CanGoPrevious", "CanPause", "CanPlay", "CanSeek"); }
-    void on_rate_changed        ( auto &&fn) { rate_changed_fn        = fn;                                                                                        }
-    void on_shuffle_changed     ( auto &&fn) { shuffle_changed_fn     = fn; control_props_changed("CanGoNext", "CanGoPrevious", "CanPause", "CanPlay", "CanSeek"); }
-    void on_volume_changed      ( auto &&fn) { volume_changed_fn      = fn; control_props_changed("CanGoNext", "CanGoPrevious", "CanPause", "CanPlay", "CanSeek"); }
-
-    void set_fullscreen(bool value)                         { fullscreen            = value; prop_changed(MP2,  "Fullscreen"          , sdbus::Variant(fullscreen));                                         }
-    void set_identity(std::string_view value)               { identity              = value; prop_changed(MP2,  "Identity"            , sdbus::Variant(identity));                                           }
-    void set_desktop_entry(std::string_view value)          { desktop_entry         = value; prop_changed(MP2,  "DesktopEntry"        , sdbus::Variant(desktop_entry));                                      }
-    void set_supported_uri_schemes(const StringList &value) { supported_uri_schemes = value; prop_changed(MP2,  "SupportedUriSchemes" , sdbus::Variant(supported_uri_schemes));                              }
-    void set_supported_mime_types(const StringList &value)  { supported_mime_types  = value; prop_changed(MP2,  "SupportedMimeTypes"  , sdbus::Variant(supported_mime_types));                               }
-    void set_playback_status(PlaybackStatus value)          { playback_status       = value; prop_changed(MP2P, "PlaybackStatus"      , sdbus::Variant(detail::playback_status_to_string(playback_status))); }
-    void set_loop_status(LoopStatus value)                  { loop_status           = value; prop_changed(MP2P, "LoopStatus"          , sdbus::Variant(detail::loop_status_to_string(loop_status)));         }
-    void set_shuffle(bool value)                            { shuffle               = value; prop_changed(MP2P, "Shuffle"             , sdbus::Variant(shuffle));                                            }
-    void set_volume(double value)                           { volume                = value; prop_changed(MP2P, "Volume"              , sdbus::Variant(volume));                                             }
-    void set_position(int64_t value)                        { position              = value;                                                                                                                 }
+// Seqlock around a PositionAnchor: readers retry instead of blocking if they
+// raced with a writer. Writers must be serialized by the caller. All accesses
+// are sequentially consistent, which keeps it simple and free of fences.
+class AtomicAnchor {
+    std::atomic<uint64_t> seq      = 0;
+    std::atomic<int64_t>  position = 0;
+    std::atomic<std::chrono::steady_clock::rep> time = 0;
+    std::atomic<double>   rate     = 1.0;
+    std::atomic<bool>     playing  = false;
+    std::atomic<int64_t>  length   = -1;
 
-    void set_rate(double value)
+public:
+    AtomicAnchor() { store(PositionAnchor{}); }
+
+    PositionAnchor load() const
     {
-        if (value == 0.0) {
-            fprintf(stderr, "warning: rate value must not be 0.0.\n");
-            return;
+        for (;;) {
+            auto s = seq.load();
+            if (s & 1)
+                continue;
+            PositionAnchor a;
+            a.position = position.load();
+            a.time     = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(time.load()));
+            a.rate     = rate.load();
+            a.playing  = playing.load();
+            a.length   = length.load();
+            if (seq.load() == s)
+                return a;
         }
-        if (value < minimum_rate || value > maximum_rate) {
-            fprintf(stderr, "warning: rate value not in range.\n");
-            return;
+    }
+
+    void store(const PositionAnchor &a)
+    {
+        auto s = seq.load();
+        seq.store(s + 1);
+        position.store(a.position);
+        time.store(a.time.time_since_epoch().count());
+        rate.store(a.rate);
+        playing.store(a.playing);
+        length.store(a.length);
+        seq.store(s + 2);
+    }
+};
+
+// Bounded single-producer, single-consumer queue. Both push() and pop() are
+// wait-free and never allocate.
+template <typename T, std::size_t N>
+class SpscQueue {
+    static_assert((N & (N - 1)) == 0, "size must be a power of two");
+    std::array<T, N> buf;
+    alignas(64) std::atomic<std::size_t> head = 0;
+    alignas(64) std::atomic<std::size_t> tail = 0;
+
+public:
+    bool push(const T &value)
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+            return false;
+        buf[t & (N - 1)] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &value)
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        value = buf[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // only meaningful to the producer: once false, the next push() succeeds
+    bool full() const
+    {
+        return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) == N;
+    }
+};
+
+#ifdef MPRIS_SERVER_METRICS
+
+class MetricsRecorder {
+    struct Caller {
+        uint64_t calls     = 0;
+        uint64_t last_seen = 0;
+    };
+
+    mutable std::mutex mutex;
+    Metrics data; // callers aside
+    std::map<std::string, Caller, std::less<>> callers;
+    uint64_t clock = 0;
+    std::atomic<uint64_t> emitted   = 0;
+    std::atomic<uint64_t> coalesced = 0;
+
+public:
+    void call(std::string_view member, std::string_view sender, std::chrono::nanoseconds time)
+    {
+        std::lock_guard lock(mutex);
+        auto m = data.members.find(member);
+        if (m == data.members.end())
+            m = data.members.emplace(std::string(member), MemberMetrics{}).first;
+        m->second.calls++;
+        m->second.total_time += time;
+        auto us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(time).count());
+        m->second.latency_histogram[std::min<std::size_t>(std::bit_width(us), m->second.latency_histogram.size() - 1)]++;
+        auto c = callers.find(sender);
+        if (c == callers.end()) {
+            // every short-lived client has a unique name of its own
+            if (callers.size() == Metrics::max_callers)
+                callers.erase(std::min_element(callers.begin(), callers.end(), [] (const auto &a, const auto &b) {
+                    return a.second.last_seen < b.second.last_seen;
+                }));
+            c = callers.emplace(std::string(sender), Caller{}).first;
         }
-        rate = value;
-        prop_changed(MP2P, "Rate", sdbus::Variant(rate));
+        c->second.calls++;
+        c->second.last_seen = ++clock;
     }
 
-    void set_metadata(const std::map<Field, sdbus::Variant> &value)
+    void signal(uint64_t n = 1)    { emitted.fetch_add(n, std::memory_order_relaxed); }
+    void coalesce(uint64_t n = 1)  { coalesced.fetch_add(n, std::memory_order_relaxed); }
+
+    Metrics snapshot() const
     {
-        metadata.clear();
-        for (auto [k, v] : value)
-            metadata[detail::field_to_string(k)] = v;
-        prop_changed(MP2P, "Metadata", sdbus::Variant(metadata));
+        std::lock_guard lock(mutex);
+        auto r = data;
+        for (const auto &[name, c] : callers)
+            r.callers.emplace(name, c.calls);
+        r.signals_emitted   = emitted.load(std::memory_order_relaxed);
+        r.signals_coalesced = coalesced.load(std::memory_order_relaxed);
+        return r;
     }
+};
 
-    void set_minimum_rate(double value)
+#else
+
+class MetricsRecorder {
+public:
+    void call(std::string_view member, std::string_view sender, std::chrono::nanoseconds time) { }
+    void signal(uint64_t n = 1)   { }
+    void coalesce(uint64_t n = 1) { }
+    Metrics snapshot() const      { return {}; }
+};
+
+#endif
+
+// Fixed set of threads running jobs from a bounded queue. Jobs still queued
+// on destruction are run before the threads exit.
+class WorkerPool {
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::size_t capacity;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+
+    void run()
     {
-        if (value > 1.0) {
-            fprintf(stderr, "warning: minimum value should always be 1.0 or lower\n");
-            return;
+        std::unique_lock lock(mutex);
+        for (;;) {
+            cv.wait(lock, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            auto job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
         }
-        minimum_rate = value;
-        prop_changed(MP2P, "MinimumRate", sdbus::Variant(minimum_rate));
     }
 
-    void set_maximum_rate(double value)
+public:
+    WorkerPool(std::size_t num_threads, std::size_t capacity)
+        : capacity(capacity)
     {
-        if (value < 1.0) {
-            fprintf(stderr, "warning: maximum rate should always be 1.0 or higher\n");
-            return;
+        for (std::size_t i = 0; i < num_threads; i++)
+            threads.emplace_back([this] { run(); });
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
         }
-        maximum_rate = value;
-        prop_changed(MP2P, "MaximumRate", sdbus::Variant(maximum_rate));
+        cv.notify_all();
+        for (auto &t : threads)
+            t.join();
     }
 
-    void send_seeked_signal(int64_t position);
+    // Returns false if the queue is full.
+    bool submit(std::function<void()> job)
+    {
+        {
+            std::lock_guard lock(mutex);
+            if (jobs.size() >= capacity)
+                return false;
+            jobs.push_back(std::move(job));
+        }
+        cv.notify_one();
+        return true;
+    }
 };
 
-#ifndef MPRIS_SERVER_NO_IMPL
-
-inline void Server::prop_changed(const std::string &interface, const std::string &name, sdbus::Variant value)
-{
-    std::map<std::string, sdbus::Variant> d;
-    d[name] = value;
-    object->emitSignal("PropertiesChanged").onInterface("org.freedesktop.DBus.Properties").withArguments(interface, d, std::vector<std::string>{});
-}
+struct StringHash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+};
 
-inline void Server::control_props_changed(auto&&... args)
-{
-    auto f = [&] (std::string_view name) {
-        if (name == "CanGoNext")     return can_go_next();
-        if (name == "CanGoPrevious") return can_go_previous();
-        if (name == "CanPause")      return can_pause();
-        if (name == "CanPlay")       return can_play();
-        if (name == "CanSeek")       return can_seek();
-        return false;
+// Ordered list of tracks, implemented as an implicit treap whose nodes live
+// in a single vector. Tracks are found by id in O(1) and inserted or removed
+// at any position in O(log n). Values are kept typed as in TrackMetadata and
+// only marshaled when sent. Values of the fields tracks usually have in
+// common (album, artists, genres...) are interned and reference counted, so
+// tracks from the same album share them.
+class TrackList {
+    struct Interned {
+        FieldValue value;
+        uint32_t refs = 0;
     };
-    std::map<std::string, sdbus::Variant> d;
-    auto g = [&] (const std::string &v) { if (f(v)) d[v] = sdbus::Variant(true); };
-    (g(args), ...);
-    object->emitSignal("PropertiesChanged").onInterface("org.freedesktop.DBus.Properties").withArguments(MP2P, d, std::vector<std::string>{});
-}
+    using InternedEntry = std::pair<const std::string, Interned>;
 
-inline void Server::set_fullscreen_external(bool value)
-{
-    if (fullscreen_changed_fn)
-        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Cannot set Fullscreen (CanSetFullscreen is false).");
-    set_fullscreen(value);
-    fullscreen_changed_fn(fullscreen);
-}
+public:
+    struct Track {
+        const std::string *id = nullptr;
+        std::vector<std::pair<Field, FieldValue>> values;      // this track's own
+        std::vector<std::pair<Field, InternedEntry *>> shared; // interned
 
-inline void Server::set_loop_status_external(const std::string &value)
-{
-    for (auto i = 0u; i < std::size(loop_status_strings); i++) {
-        if (value == loop_status_strings[i]) {
-            if (!can_control())
-                throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Cannot set loop status (CanControl is false).");
-            set_loop_status(static_cast<LoopStatus>(i));
-            loop_status_changed_fn(loop_status);
+        void for_each_field(auto &&fn) const
+        {
+            for (const auto &[f, v] : values)
+                fn(f, v);
+            for (const auto &[f, e] : shared)
+                fn(f, e->second.value);
         }
-    }
-}
+    };
 
-inline void Server::set_rate_external(double value)
-{
-    if (value <= minimum_rate || value > maximum_rate)
-        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Rate value not in range.");
-    if (value == 0.0)
-        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Rate value must not be 0.0.");
-    set_rate(value);
-    if (rate_changed_fn)
-        rate_changed_fn(rate);
-}
+private:
+    static constexpr uint32_t NIL = UINT32_MAX;
 
-inline void Server::set_shuffle_external(bool value)
-{
-    if (!can_control())
-        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Cannot set shuffle (CanControl is false).");
-    set_shuffle(value);
-    shuffle_changed_fn(shuffle);
-}
+    struct Node {
+        uint32_t left     = NIL;
+        uint32_t right    = NIL;
+        uint32_t parent   = NIL;
+        uint32_t size     = 1;
+        uint32_t priority = 0;
+        Track track;
+    };
 
-inline void Server::set_volume_external(double value)
-{
-    if (!can_control())
-        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Cannot set volume (CanControl is false).");
-    set_volume(value);
-    volume_changed_fn(volume);
-}
+    std::vector<Node> nodes;
+    std::vector<uint32_t> free_nodes;
+    uint32_t root = NIL;
+    std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>> index;
+    std::unordered_map<std::string, Interned> interned;
+    std::minstd_rand rng;
 
-inline void Server::set_position_method(sdbus::ObjectPath id, int64_t pos)
-{
-    if (!can_seek())
-        return;
-    auto tid = metadata.find(detail::field_to_string(Field::TrackId));
-    if (tid == metadata.end() || tid->second.get<std::string>() != id)
-        return;
-    set_position_fn(pos);
-}
+    uint32_t size_of(uint32_t n) const { return n == NIL ? 0 : nodes[n].size; }
 
-inline void Server::open_uri(const std::string &uri)
-{
-    if (open_uri_fn)
-        open_uri_fn(uri);
-}
+    void update(uint32_t n)
+    {
+        auto &x = nodes[n];
+        x.size = 1 + size_of(x.left) + size_of(x.right);
+        if (x.left  != NIL) nodes[x.left].parent  = n;
+        if (x.right != NIL) nodes[x.right].parent = n;
+    }
 
-inline std::unique_ptr<Server> Server::make(std::string_view name)
-{
-    try {
-        auto s = std::make_unique<Server>(name);
-        return s;
-    } catch (const sdbus::Error &error) {
-        return nullptr;
+    // splits t into the first k nodes and the rest
+    std::pair<uint32_t, uint32_t> split(uint32_t t, uint32_t k)
+    {
+        if (t == NIL)
+            return { NIL, NIL };
+        nodes[t].parent = NIL;
+        if (size_of(nodes[t].left) < k) {
+            auto [l, r] = split(nodes[t].right, k - size_of(nodes[t].left) - 1);
+            nodes[t].right = l;
+            update(t);
+            return { t, r };
+        }
+        auto [l, r] = split(nodes[t].left, k);
+        nodes[t].left = r;
+        update(t);
+        return { l, t };
     }
-}
 
-inline Server::Server(std::string_view name)
-    : service_name(PREFIX + std::string(name))
-{
-    connection = sdbus::createSessionBusConnection();
-    connection->requestName(sdbus::ServiceName{service_name});
-    object = sdbus::createObject(*connection, sdbus::ObjectPath{OBJECT_PATH});
+    uint32_t merge(uint32_t a, uint32_t b)
+    {
+        if (a == NIL) return b;
+        if (b == NIL) return a;
+        if (nodes[a].priority > nodes[b].priority) {
+            nodes[a].right = merge(nodes[a].right, b);
+            update(a);
+            return a;
+        }
+        nodes[b].left = merge(a, nodes[b].left);
+        update(b);
+        return b;
+    }
 
-#define M(f) detail::member_fn(this, &Server::f)
-    object->addVTable(sdbus::registerMethod("Raise").implementedAs([&] { if (raise_fn) raise_fn(); })
-                    , sdbus::registerMethod("Quit") .implementedAs([&] { if (quit_fn)  quit_fn();  })
-
-                    , sdbus::registerProperty("CanQuit")            .withGetter([&] { return bool(quit_fn); })
-                    , sdbus::registerProperty("Fullscreen")         .withGetter([&] { return fullscreen; }).withSetter(M(set_fullscreen_external))
-                    , sdbus::registerProperty("CanSetFullscreen")   .withGetter([&] { return bool(fullscreen_changed_fn); })
-                    , sdbus::registerProperty("CanRaise")           .withGetter([&] { return bool(raise_fn); })
-                    , sdbus::registerProperty("HasTrackList")       .withGetter([&] { return false; })
-                    , sdbus::registerProperty("Identity")           .withGetter([&] { return identity; })
-                    , sdbus::registerProperty("DesktopEntry")       .withGetter([&] { return desktop_entry; })
-                    , sdbus::registerProperty("SupportedUriSchemes").withGetter([&] { return supported_uri_schemes; })
-                    , sdbus::registerProperty("SupportedMimeTypes") .withGetter([&] { return supported_mime_types; })
-                    ).forInterface(MP2);
+    void set_root(uint32_t n)
+    {
+        root = n;
+        if (root != NIL)
+            nodes[root].parent = NIL;
+    }
 
-    object->addVTable(sdbus::registerMethod("Next")       .implementedAs([&] { if (can_go_next())             next_fn();       })
-                    , sdbus::registerMethod("Previous")   .implementedAs([&] { if (can_go_previous())         previous_fn();   })
-                    , sdbus::registerMethod("Pause")      .implementedAs([&] { if (can_pause())               pause_fn();      })
-                    , sdbus::registerMethod("PlayPause")  .implementedAs([&] { if (can_play() || can_pause()) play_pause_fn(); })
-                    , sdbus::registerMethod("Stop")       .implementedAs([&] { if (can_control())             stop_fn();       })
-                    , sdbus::registerMethod("Play")       .implementedAs([&] { if (can_play())                play_fn();       })
-                    , sdbus::registerMethod("Seek")       .implementedAs([&] (int64_t n) { if (can_seek()) seek_fn(n); }).withInputParamNames("Offset")
-                    , sdbus::registerMethod("SetPosition").implementedAs(M(set_position_method))                         .withInputParamNames("TrackId", "Position")
-                    , sdbus::registerMethod("OpenUri")    .implementedAs(M(open_uri))                                    .withInputParamNames("Uri")
-
-                    , sdbus::registerProperty("PlaybackStatus").withGetter([&] { return detail::playback_status_to_string(playback_status); })
-                    , sdbus::registerProperty("LoopStatus")    .withGetter([&] { return detail::loop_status_to_string(loop_status); }).withSetter(M(set_loop_status_external))
-                    , sdbus::registerProperty("Rate")          .withGetter([&] { return rate; }).withSetter(M(set_rate_external))
-                    , sdbus::registerProperty("Shuffle")       .withGetter([&] { return shuffle; }).withSetter(M(set_shuffle_external))
-                    , sdbus::registerProperty("Metadata")      .withGetter([&] { return metadata; })
-                    , sdbus::registerProperty("Volume")        .withGetter([&] { return volume; }).withSetter(M(set_volume_external))
-                    , sdbus::registerProperty("Position")      .withGetter([&] { return position; })
-                    , sdbus::registerProperty("MinimumRate")   .withGetter([&] { return minimum_rate; })
-                    , sdbus::registerProperty("MaximumRate")   .withGetter([&] { return maximum_rate; })
-                    , sdbus::registerProperty("CanGoNext")     .withGetter(M(can_go_next))
-                    , sdbus::registerProperty("CanGoPrevious") .withGetter(M(can_go_previous))
-                    , sdbus::registerProperty("CanPlay")       .withGetter(M(can_play))
-                    , sdbus::registerProperty("CanPause")      .withGetter(M(can_pause))
-                    , sdbus::registerProperty("CanSeek")       .withGetter(M(can_seek))
-                    , sdbus::registerProperty("CanControl")    .withGetter(M(can_control))
+    uint32_t last() const
+    {
+        auto n = root;
+        while (nodes[n].right != NIL)
+            n = nodes[n].right;
+        return n;
+    }
 
-                    , sdbus::registerSignal("Seeked").withParameters<int64_t>("Position")
-                    ).forInterface(MP2P);
-#undef M
-}
+    uint32_t position(uint32_t n) const
+    {
+        auto pos = size_of(nodes[n].left);
+        for (auto p = nodes[n].parent; p != NIL; n = p, p = nodes[p].parent)
+            if (nodes[p].right == n)
+                pos += size_of(nodes[p].left) + 1;
+        return pos;
+    }
 
-inline void Server::start_loop()       { connection->enterEventLoop(); }
-inline void Server::start_loop_async() { connection->enterEventLoopAsync(); }
+    static bool shared_field(Field f)
+    {
+        return f == Field::Album    || f == Field::AlbumArtist || f == Field::Artist
+            || f == Field::Composer || f == Field::Genre       || f == Field::Lyricist;
+    }
 
-inline void Server::send_seeked_signal(int64_t position)
-{
-    object->emitSignal("Seeked").onInterface(MP2P).withArguments(position);
-}
+    // drops the node's references to interned values, and the values no
+    // other track uses
+    void release(uint32_t n)
+    {
+        auto &shared = nodes[n].track.shared;
+        for (auto [_, entry] : shared)
+            if (--entry->second.refs == 0)
+                interned.erase(interned.find(entry->first));
+        shared.clear();
+    }
 
-#else
+    void set_node_metadata(uint32_t n, const std::map<Field, sdbus::Variant> &metadata)
+    {
+        release(n);
+        auto &t = nodes[n].track;
+        auto num_shared = std::count_if(metadata.begin(), metadata.end(), [] (const auto &p) { return shared_field(p.first); });
+        t.values.clear();
+        t.values.reserve(metadata.size() - num_shared);
+        t.shared.reserve(num_shared);
+        for (const auto &[k, v] : metadata) {
+            auto value = field_value_from_variant(field_table[static_cast<int>(k)], v);
+            auto key = shared_field(k) ? intern_key(value) : std::nullopt;
+            if (!key) {
+                t.values.emplace_back(k, std::move(value));
+                continue;
+            }
+            auto &entry = *interned.try_emplace(std::move(*key), Interned{ std::move(value) }).first;
+            entry.second.refs++;
+            t.shared.emplace_back(k, &entry);
+        }
+    }
 
-inline void Server::prop_changed(const std::string &interface, const std::string &name, sdbus::Variant value) { }
-inline void Server::control_props_changed(auto&&... args) { }
-inline void Server::set_fullscreen_external(bool value) { }
-inline void Server::set_loop_status_external(const std::string &value) { }
-inline void Server::set_rate_external(double value) { }
-inline void Server::set_shuffle_external(bool value) { }
+public:
+    std::size_t size() const { return index.size(); }
+
+    const Track *find(std::string_view id) const
+    {
+        auto it = index.find(id);
+        return it == index.end() ? nullptr : &nodes[it->second].track;
+    }
+
+    // Inserts a track after another one (at the start if after is empty or
+    // NO_TRACK, at the end if it isn't found). Returns the id of the track it
+    // ended up after (NO_TRACK if first), or nothing if the id is already in
+    // the list.
+    std::optional<std::string_view> insert(std::string_view id, const std::map<Field, sdbus::Variant> &metadata, std::string_view after)
+    {
+        auto [it, inserted] = index.try_emplace(std::string(id), NIL);
+        if (!inserted)
+            return std::nullopt;
+        uint32_t pos = 0;
+        std::string_view prev = NO_TRACK;
+        if (!after.empty() && after != NO_TRACK) {
+            auto a = index.find(after);
+            if (a != index.end() && a->second != NIL) {
+                pos  = position(a->second) + 1;
+                prev = a->first;
+            } else if (root != NIL) {
+                pos  = size_of(root);
+                prev = *nodes[last()].track.id;
+            }
+        }
+        uint32_t n;
+        if (free_nodes.empty()) {
+            n = nodes.size();
+            nodes.emplace_back();
+        } else {
+            n = free_nodes.back();
+            free_nodes.pop_back();
+            nodes[n] = Node{};
+        }
+        nodes[n].priority       = rng();
+        nodes[n].track.id       = &it->first;
+        set_node_metadata(n, metadata);
+        it->second = n;
+        auto [l, r] = split(root, pos);
+        set_root(merge(merge(l, n), r));
+        return prev;
+    }
+
+    bool erase(std::string_view id)
+    {
+        auto it = index.find(id);
+        if (it == index.end())
+            return false;
+        auto n = it->second;
+        auto [l, mr] = split(root, position(n));
+        auto [m, r]  = split(mr, 1);
+        set_root(merge(l, r));
+        release(m);
+        nodes[m].track = Track{};
+        free_nodes.push_back(m);
+        index.erase(it);
+        return true;
+    }
+
+    bool set_metadata(std::string_view id, const std::map<Field, sdbus::Variant> &metadata)
+    {
+        auto it = index.find(id);
+        if (it == index.end())
+            return false;
+        set_node_metadata(it->second, metadata);
+        return true;
+    }
+
+    void clear()
+    {
+        nodes.clear();
+        free_nodes.clear();
+        index.clear();
+        interned.clear();
+        root = NIL;
+    }
+
+    // calls fn on each track in order
+    void for_each(auto &&fn) const
+    {
+        std::vector<uint32_t> stack;
+        for (auto n = root; n != NIL || !stack.empty(); ) {
+            if (n != NIL) {
+                stack.push_back(n);
+                n = nodes[n].left;
+            } else {
+                n = stack.back();
+                stack.pop_back();
+                fn(nodes[n].track);
+                n = nodes[n].right;
+            }
+        }
+    }
+};
+
+} // namespace detail
+
+template <Field F>
+using field_type = std::variant_alternative_t<detail::field_value_index(detail::field_table[static_cast<int>(F)].signature), detail::FieldValue>;
+
+// Metadata of a track, with one slot per Field typed as the MPRIS spec wants
+// (see field_type) and an extension slot for other keys. Marshals straight
+// to a{sv}. Copies share their values, so editing a field of a copy only
+// allocates that field.
+class TrackMetadata {
+    using Extras = std::map<std::string, sdbus::Variant, std::less<>>;
+
+    std::array<std::shared_ptr<const detail::FieldValue>, detail::field_table.size()> values;
+    std::shared_ptr<Extras> extras;
+
+    Extras &own_extras()
+    {
+        if (!extras || extras.use_count() > 1)
+            extras = extras ? std::make_shared<Extras>(*extras) : std::make_shared<Extras>();
+        return *extras;
+    }
+
+public:
+    TrackMetadata() = default;
+
+    explicit TrackMetadata(const std::map<Field, sdbus::Variant> &map)
+    {
+        for (const auto &[k, v] : map)
+            set(k, v);
+    }
+
+    template <Field F>
+    TrackMetadata &set(field_type<F> value)
+    {
+        values[static_cast<int>(F)] = std::make_shared<const detail::FieldValue>(std::in_place_type<field_type<F>>, std::move(value));
+        return *this;
+    }
+
+    // untyped: stored in the typed slot if it holds the type the spec
+    // requires, otherwise sent with whatever type it holds
+    TrackMetadata &set(Field field, const sdbus::Variant &value)
+    {
+        values[static_cast<int>(field)] = std::make_shared<const detail::FieldValue>(
+            detail::field_value_from_variant(detail::field_table[static_cast<int>(field)], value));
+        return *this;
+    }
+
+    TrackMetadata &set_extra(std::string key, sdbus::Variant value)
+    {
+        own_extras().insert_or_assign(std::move(key), std::move(value));
+        return *this;
+    }
+
+    // from metadata as received over the bus: known fields holding the type
+    // the spec requires go into their typed slot
+    static TrackMetadata from_dbus(const Metadata &map)
+    {
+        TrackMetadata m;
+        for (const auto &[k, v] : map) {
+            auto f = std::find_if(detail::field_table.begin(), detail::field_table.end(), [&] (const auto &f) { return k == f.key; });
+            if (f != detail::field_table.end())
+                m.values[static_cast<int>(f->field)] = std::make_shared<const detail::FieldValue>(detail::field_value_from_variant(*f, v));
+            else
+                m.set_extra(k, v);
+        }
+        return m;
+    }
+
+    template <Field F>
+    const field_type<F> *get() const
+    {
+        const auto &v = values[static_cast<int>(F)];
+        return v ? std::get_if<field_type<F>>(v.get()) : nullptr;
+    }
+
+    const detail::FieldValue &value(Field field) const
+    {
+        static const detail::FieldValue none;
+        const auto &v = values[static_cast<int>(field)];
+        return v ? *v : none;
+    }
+
+    const Extras &extra() const
+    {
+        static const Extras none;
+        return extras ? *extras : none;
+    }
+
+    // sets a value as returned by value(), typed or not
+    TrackMetadata &set_value(Field field, detail::FieldValue value)
+    {
+        values[static_cast<int>(field)] = std::make_shared<const detail::FieldValue>(std::move(value));
+        return *this;
+    }
+
+    bool has(Field field) const { return !std::holds_alternative<std::monostate>(value(field)); }
+    void erase(Field field)     { values[static_cast<int>(field)].reset(); }
+
+    void erase_extra(std::string_view key)
+    {
+        if (!extra().contains(key))
+            return;
+        auto &e = own_extras();
+        e.erase(e.find(key));
+    }
+
+    // copies every field and extra key set in other
+    void merge(const TrackMetadata &other)
+    {
+        for (std::size_t i = 0; i < values.size(); i++)
+            if (other.values[i])
+                values[i] = other.values[i];
+        if (other.extra().empty())
+            return;
+        auto &e = own_extras();
+        for (const auto &[k, v] : other.extra())
+            e.insert_or_assign(k, v);
+    }
+
+    bool operator==(const TrackMetadata &other) const
+    {
+        for (std::size_t i = 0; i < values.size(); i++)
+            if (values[i] != other.values[i] && !detail::field_value_equal(value(static_cast<Field>(i)), other.value(static_cast<Field>(i))))
+                return false;
+        const auto &a = extra(), &b = other.extra();
+        return &a == &b
+            || (a.size() == b.size()
+                && std::equal(a.begin(), a.end(), b.begin(), [] (const auto &x, const auto &y) {
+                       return x.first == y.first && detail::variant_equal(x.second, y.second);
+                   }));
+    }
+};
+
+} // namespace mpris
+
+#ifndef MPRIS_SERVER_NO_IMPL
+
+namespace sdbus {
+
+template <> struct signature_of<mpris::TrackMetadata> : signature_of<std::map<std::string, Variant>> { };
+
+inline Message &operator<<(Message &msg, const mpris::TrackMetadata &m)
+{
+    msg.openContainer("{sv}");
+    for (const auto &f : mpris::detail::field_table) {
+        const auto &value = m.value(f.field);
+        if (std::holds_alternative<std::monostate>(value))
+            continue;
+        msg.openDictEntry("sv");
+        msg << f.key;
+        std::visit([&] <typename T> (const T &v) {
+            if constexpr (std::is_same_v<T, Variant>) {
+                msg << v;
+            } else if constexpr (!std::is_same_v<T, std::monostate>) {
+                msg.openVariant(f.signature);
+                msg << v;
+                msg.closeVariant();
+            }
+        }, value);
+        msg.closeDictEntry();
+    }
+    for (const auto &[k, v] : m.extra()) {
+        msg.openDictEntry("sv");
+        msg << k;
+        msg << v;
+        msg.closeDictEntry();
+    }
+    msg.closeContainer();
+    return msg;
+}
+
+} // namespace sdbus
+
+#endif
+
+namespace mpris {
+
+namespace detail {
+
+// What Get and GetAll serve for the MediaPlayer2 and MediaPlayer2.Player
+// interfaces, other than the scalars kept in atomics (and Position, which is
+// computed on every read). Rebuilt whenever one of these values changes.
+struct RootProps {
+    std::shared_ptr<const std::string> identity;
+    std::shared_ptr<const std::string> desktop_entry;
+    std::shared_ptr<const StringList>  supported_uri_schemes;
+    std::shared_ptr<const StringList>  supported_mime_types;
+    bool can_quit, can_raise, can_set_fullscreen, has_track_list;
+};
+
+struct PlayerProps {
+    std::shared_ptr<const TrackMetadata> metadata;
+    bool can_go_next, can_go_previous, can_play, can_pause, can_seek, can_control;
+};
+
+} // namespace detail
+
+// Cover art stored in a private directory under $XDG_RUNTIME_DIR (or /tmp),
+// each image named after its content, so it's written only once however many
+// tracks share it.
+// Once more than max_bytes are stored, the least recently used files are
+// removed. Everything is deleted along with the cache.
+class ArtCache {
+    struct Entry {
+        std::string path;
+        std::size_t size;
+        uint64_t last_used;
+    };
+
+    std::string dir;
+    std::size_t max_bytes;
+    std::size_t total = 0;
+    uint64_t clock    = 0;
+    std::unordered_map<std::string, Entry> entries; // by content key
+    std::map<std::tuple<std::string, int64_t, int64_t>, std::string> files; // (path, mtime, size) -> content key
+    std::mutex mutex;
+
+    std::string store(std::string_view image);
+    void evict();
+    std::string url(const std::string &key) const { return "file://" + dir + "/" + key; }
+
+public:
+    explicit ArtCache(std::size_t max_bytes = 32 * 1024 * 1024);
+    ~ArtCache();
+    ArtCache(const ArtCache &) = delete;
+    ArtCache &operator=(const ArtCache &) = delete;
+
+    // Returns a file:// URL for the image, or an empty string if it couldn't
+    // be written. Nothing is written if the same image is already cached.
+    std::string add(std::string_view image);
+    // Same, for an image file. A file seen before with the same size and
+    // modification time isn't even read again.
+    std::string add_file(const std::string &path);
+
+    const std::string &directory() const { return dir; }
+    std::size_t size();
+};
+
+class Server {
+    std::string service_name;
+    std::unique_ptr<sdbus::IConnection> connection;
+    std::unique_ptr<sdbus::IObject> object;
+    std::atomic<bool> ready = false; // object registered, signals can be sent
+    std::thread connect_thread;
+    std::mutex start_mutex;
+    bool loop_requested = false; // start_loop_async() called before ready
+
+    std::function<void(void)>               quit_fn;
+    std::function<void(void)>               raise_fn;
+    std::function<void(void)>               next_fn;
+    std::function<void(void)>               previous_fn;
+    std::function<void(void)>               pause_fn;
+    std::function<void(void)>               play_pause_fn;
+    std::function<void(void)>               stop_fn;
+    std::function<void(void)>               play_fn;
+    std::function<void(int64_t)>            seek_fn;
+    std::function<void(int64_t)>            set_position_fn;
+    std::function<void(std::string_view)>   open_uri_fn;
+    std::function<void(bool)>               fullscreen_changed_fn;
+    std::function<void(LoopStatus)>         loop_status_changed_fn;
+    std::function<void(double)>             rate_changed_fn;
+    std::function<void(bool)>               shuffle_changed_fn;
+    std::function<void(double)>             volume_changed_fn;
+    std::function<void(void)>               command_queued_fn;
+    std::function<void(std::string_view, std::string_view, bool)> add_track_fn;
+    std::function<void(std::string_view)>   remove_track_fn;
+    std::function<void(std::string_view)>   go_to_fn;
+    std::function<std::size_t(void)>        playlist_count_fn;
+    std::function<Playlist(std::size_t)>    playlist_at_fn;
+    std::function<void(std::string_view)>   activate_playlist_fn;
+    std::function<void(int64_t)>            seek_async_fn;
+    std::function<void(int64_t)>            set_position_async_fn;
+    std::function<void(std::string_view)>   open_uri_async_fn;
+
+    std::unique_ptr<detail::WorkerPool> workers;     // OpenUri
+    std::unique_ptr<detail::WorkerPool> seek_worker; // Seek and SetPosition, in order
+    std::size_t worker_threads    = 2;
+    std::size_t worker_queue_size = 32;
+
+    std::atomic<DispatchMode> dispatch_mode = DispatchMode::Immediate;
+    std::unique_ptr<detail::SpscQueue<Command, 256>> commands;
+    int command_event_fd = -1;
+
+    std::atomic<bool> fullscreen                     = false;
+    detail::Snapshot<std::string> identity           {};
+    detail::Snapshot<std::string> desktop_entry      {};
+    detail::Snapshot<StringList> supported_uri_schemes {};
+    detail::Snapshot<StringList> supported_mime_types  {};
+    std::atomic<PlaybackStatus> playback_status      = PlaybackStatus::Stopped;
+    std::atomic<LoopStatus> loop_status              = LoopStatus::None;
+    std::atomic<double> rate                         = 1.0;
+    std::atomic<bool> shuffle                        = false;
+    detail::Snapshot<TrackMetadata> metadata         {};
+    std::atomic<double> volume                       = 0.0;
+    detail::AtomicAnchor anchor                      {};
+    std::atomic<int64_t> seek_tolerance              = 200'000;
+    std::atomic<double> maximum_rate                 = 1.0;
+    std::atomic<double> minimum_rate                 = 1.0;
+    detail::Snapshot<detail::RootProps> root_props     {};
+    detail::Snapshot<detail::PlayerProps> player_props {};
+    std::mutex props_mutex;
+
+    // Taken by writers only (setters, on_* registrations); getters running on
+    // the event loop thread read atomics and snapshots without locking.
+    std::mutex write_mutex;
+    std::mutex pending_mutex;
+
+    [[no_unique_address]] detail::MetricsRecorder metrics_recorder;
+
+    std::unique_ptr<detail::TrackList> tracklist;
+    std::atomic<bool> tracklist_created = false;
+    std::mutex tracklist_mutex;
+
+    std::vector<PlaylistOrdering> playlist_orderings = { PlaylistOrdering::UserDefined, PlaylistOrdering::Alphabetical };
+    std::map<PlaylistOrdering, std::vector<uint32_t>> playlist_orders; // cached permutations, UserDefined excluded
+    std::optional<Playlist> active_playlist;
+    std::mutex playlists_mutex;
+
+    int batch_depth = 0;
+    detail::PropMask pending = 0;
+
+    std::array<detail::Throttle, std::size(detail::prop_table)> throttles;
+    detail::PropMask throttled = 0;
+    std::thread throttle_thread;
+    std::condition_variable throttle_cv;
+    bool stopping = false;
+    bool external_loop = false; // throttles are flushed by process_pending()
+    int throttle_event_fd = -1; // wakes the external loop for a pending throttle
+
+    static inline const std::string *const interfaces[] = { &MP2, &MP2P, &MP2TL, &MP2PL };
+
+    void prop_changed(detail::Prop prop) { emit_props(detail::prop_bit(prop)); }
+    void refresh_props(detail::PropMask props);
+
+    // Under props_mutex, since refresh_props() reads the callbacks to compute
+    // the Can* properties, possibly from make_async()'s connect thread.
+    template <typename F>
+    void set_fn(std::function<F> &member, auto &&fn)
+    {
+        std::lock_guard lock(props_mutex);
+        member = fn;
+    }
+    detail::RootProps make_root_props() const;
+    detail::PlayerProps make_player_props() const;
+    const detail::RootProps &root_view() const;
+    const detail::PlayerProps &player_view() const;
+    void control_props_changed(auto... props);
+    void emit_props(detail::PropMask props);
+    void send_props(detail::PropMask props);
+    void write_prop(detail::Prop prop, sdbus::Message &msg);
+    bool throttle(detail::Prop prop, std::chrono::steady_clock::time_point now);
+    void throttle_loop();
+    std::chrono::steady_clock::time_point flush_throttles(std::chrono::steady_clock::time_point now);
+    void stop_throttle_thread();
+
+    void edit_metadata(auto &&fn)
+    {
+        std::lock_guard lock(write_mutex);
+        auto old = metadata.load();
+        auto m = *old;
+        fn(m);
+        if (m == *old)
+            return;
+        auto a = anchor.load();
+        a.length = detail::track_length(m.value(Field::Length));
+        anchor.store(a);
+        metadata.store(std::move(m));
+        prop_changed(detail::Prop::Metadata);
+    }
+
+    // must be called with write_mutex held
+    detail::PositionAnchor reanchor() const
+    {
+        auto a = anchor.load();
+        auto now = std::chrono::steady_clock::now();
+        a.position = a.at(now);
+        a.time     = now;
+        return a;
+    }
+
+    template <typename T, typename U>
+    static bool assign(std::atomic<T> &field, U value)
+    {
+        return field.exchange(value) != value;
+    }
+
+    template <typename T, typename U>
+    bool assign(detail::Snapshot<T> &field, const U &value)
+    {
+        std::lock_guard lock(write_mutex);
+        if (*field.load() == value)
+            return false;
+        field.store(T(value));
+        return true;
+    }
+
+    bool can_control()     const { return bool(loop_status_changed_fn) && bool(shuffle_changed_fn)
+                                       && bool(volume_changed_fn)      && bool(stop_fn);                }
+    bool can_go_next()     const { return can_control() && bool(next_fn);                               }
+    bool can_go_previous() const { return can_control() && bool(previous_fn);                           }
+    bool can_play()        const { return can_control() && bool(play_fn)      && bool(play_pause_fn);   }
+    bool can_pause()       const { return can_control() && bool(pause_fn)     && bool(play_pause_fn);   }
+    bool can_seek()        const { return can_control() && (bool(seek_fn) || bool(seek_async_fn))
+                                       && (bool(set_position_fn) || bool(set_position_async_fn));       }
+
+    void set_fullscreen_external(bool value);
+    void set_loop_status_external(const std::string &value);
+    void set_rate_external(double value);
+    void set_shuffle_external(bool value);
+    void set_volume_external(double value);
+    bool is_current_track(const sdbus::ObjectPath &id) const;
+    void seek_method(sdbus::Result<> &&result, int64_t offset);
+    void set_position_method(sdbus::Result<> &&result, sdbus::ObjectPath id, int64_t pos);
+    void open_uri(sdbus::Result<> &&result, const std::string &uri);
+    void invoke(const Command &cmd, const std::function<void()> &accepted = {});
+    void reply(sdbus::Result<> &&result, const std::function<void()> &fn);
+    void run_async(detail::WorkerPool *pool, sdbus::Result<> &&result, std::function<void()> job);
+    void start_workers()     { if (!workers)     workers     = std::make_unique<detail::WorkerPool>(worker_threads, worker_queue_size); }
+    void start_seek_worker() { if (!seek_worker) seek_worker = std::make_unique<detail::WorkerPool>(1, worker_queue_size); }
+
+    struct Deferred { };
+    Server(std::string_view player_name, Deferred) : service_name(PREFIX + std::string(player_name)) { }
+    void register_object();
+    void connect_async(std::function<void(const StartResult &)> on_ready);
+
+    template <typename F>
+    auto instrument(const char *member, F &&fn);
+    template <typename R, typename... Args>
+    std::function<R(Args...)> instrument_fn(const char *member, std::function<R(Args...)> fn);
+
+    bool has_track_list()  const { return tracklist_created; }
+    bool can_edit_tracks() const { return bool(add_track_fn) && bool(remove_track_fn); }
+    detail::TrackList &tracks();
+    static TrackMetadata track_metadata(const detail::TrackList::Track &track);
+    std::vector<TrackMetadata> get_tracks_metadata(const std::vector<sdbus::ObjectPath> &ids);
+    void add_track_method(const std::string &uri, sdbus::ObjectPath after, bool set_as_current);
+    void remove_track_method(sdbus::ObjectPath id);
+    void go_to_method(sdbus::ObjectPath id);
+    std::vector<sdbus::ObjectPath> track_ids();
+
+    uint32_t playlist_count() const { return playlist_count_fn ? playlist_count_fn() : 0; }
+    const std::vector<uint32_t> &playlist_order(PlaylistOrdering order);
+    std::vector<detail::DBusPlaylist> get_playlists(uint32_t index, uint32_t max_count, const std::string &order, bool reverse);
+    void activate_playlist_method(sdbus::ObjectPath id);
+    StringList get_playlist_orderings();
+    sdbus::Struct<bool, detail::DBusPlaylist> get_active_playlist();
+
+public:
+    // Groups property changes: while at least one Update is alive, changes are
+    // merged per interface and sent as a single PropertiesChanged signal when
+    // the outermost Update is destroyed.
+    class Update {
+        Server &server;
+    public:
+        explicit Update(Server &s) : server(s) { server.begin_update(); }
+        ~Update() { server.commit(); }
+        Update(const Update &) = delete;
+        Update & operator=(const Update &) = delete;
+    };
+
+    static std::unique_ptr<Server> make(std::string_view name);
+    static std::unique_ptr<Server> make(std::string_view name, std::unique_ptr<sdbus::IConnection> connection);
+    // Returns at once, without throwing. The connection is opened and the
+    // name requested on a background thread. If the name is already taken,
+    // name + ".instance<pid>" is requested instead, as the spec suggests.
+    // on_ready is called from that thread with the outcome, and may destroy
+    // the server (e.g. when starting failed). Setters and on_*
+    // can be used in the meantime and the values are served once the player
+    // is on the bus. A start_loop_async() call made before that takes effect
+    // then; start_loop() waits for it. As usual, on_* must not be called
+    // once the loop runs, so with an early start_loop_async() they must all
+    // be registered before it. poll_data(), EpollAdapter and export_metrics()
+    // must wait for a successful on_ready.
+    static std::unique_ptr<Server> make_async(std::string_view name, std::function<void(const StartResult &)> on_ready = {});
+
+    explicit Server(std::string_view player_name);
+    // Serves the player on the given connection instead of a new session bus
+    // connection. Each player needs a connection of its own, since the MPRIS
+    // object path is fixed.
+    Server(std::string_view player_name, std::unique_ptr<sdbus::IConnection> connection);
+    ~Server();
+    void start_loop();
+    void start_loop_async();
+
+    // Runs the server on the caller's event loop instead: poll_data() tells
+    // what to wait for, and process_pending() dispatches everything that is
+    // ready without blocking. Callbacks then run on the thread calling
+    // process_pending(). See EpollAdapter for a ready-made epoll binding.
+    PollData poll_data();
+    void process_pending();
+
+    [[nodiscard]] Update update() { return Update(*this); }
+    void begin_update();
+    void commit();
+
+    void on_quit                ( auto &&fn) { set_fn(quit_fn,                fn); prop_changed(detail::Prop::CanQuit);                                  }
+    void on_raise               ( auto &&fn) { set_fn(raise_fn,               fn); prop_changed(detail::Prop::CanRaise);                                 }
+    void on_next                ( auto &&fn) { set_fn(next_fn,                fn); control_props_changed(detail::Prop::CanGoNext);                       }
+    void on_previous            ( auto &&fn) { set_fn(previous_fn,            fn); control_props_changed(detail::Prop::CanGoPrevious);                   }
+    void on_pause               ( auto &&fn) { set_fn(pause_fn,               fn); control_props_changed(detail::Prop::CanPause);                        }
+    void on_play_pause          ( auto &&fn) { set_fn(play_pause_fn,          fn); control_props_changed(detail::Prop::CanPlay, detail::Prop::CanPause); }
+    void on_stop                ( auto &&fn) { set_fn(stop_fn,                fn); control_props_changed();                                              }
+    void on_play                ( auto &&fn) { set_fn(play_fn,                fn); control_props_changed(detail::Prop::CanPlay);                         }
+    void on_seek                ( auto &&fn) { set_fn(seek_fn,                fn); control_props_changed(detail::Prop::CanSeek);                         }
+    void on_set_position        ( auto &&fn) { set_fn(set_position_fn,        fn); control_props_changed(detail::Prop::CanSeek);                         }
+    void on_open_uri            ( auto &&fn) { set_fn(open_uri_fn,            fn);                                                                       }
+    void on_fullscreen_changed  ( auto &&fn) { set_fn(fullscreen_changed_fn,  fn); prop_changed(detail::Prop::CanSetFullscreen);                         }
+    void on_loop_status_changed ( auto &&fn) { set_fn(loop_status_changed_fn, fn); control_props_changed();                                              }
+    void on_rate_changed        ( auto &&fn) { set_fn(rate_changed_fn,        fn);                                                                       }
+    void on_shuffle_changed     ( auto &&fn) { set_fn(shuffle_changed_fn,     fn); control_props_changed();                                              }
+    void on_volume_changed      ( auto &&fn) { set_fn(volume_changed_fn,      fn); control_props_changed();                                              }
+    void on_command_queued      ( auto &&fn) { set_fn(command_queued_fn,      fn);                                                                       }
+    void on_add_track           ( auto &&fn) { set_fn(add_track_fn,           fn); prop_changed(detail::Prop::CanEditTracks);                            }
+    void on_remove_track        ( auto &&fn) { set_fn(remove_track_fn,        fn); prop_changed(detail::Prop::CanEditTracks);                            }
+    void on_go_to               ( auto &&fn) { set_fn(go_to_fn,               fn);                                                                       }
+    void on_playlist_count      ( auto &&fn) { set_fn(playlist_count_fn,      fn); playlists_changed();                                                  }
+    void on_playlist_at         ( auto &&fn) { set_fn(playlist_at_fn,         fn); playlists_changed();                                                  }
+    void on_activate_playlist   ( auto &&fn) { set_fn(activate_playlist_fn,   fn);                                                                       }
+
+    // Variants of on_seek(), on_set_position() and on_open_uri() whose
+    // callbacks run on worker threads, so that slow handlers don't hold up
+    // other clients. The reply is sent once the callback returns; an
+    // exception it throws is sent back as an error. Seek and SetPosition
+    // run one at a time, in the order received, on a thread of their own,
+    // since seeks are relative. OpenUri callbacks run on a bounded pool and
+    // may run concurrently; set_async_workers() sizes it and must be called
+    // before these.
+    void on_seek_async          ( auto &&fn) { set_fn(seek_async_fn,          fn); start_seek_worker(); control_props_changed(detail::Prop::CanSeek); }
+    void on_set_position_async  ( auto &&fn) { set_fn(set_position_async_fn,  fn); start_seek_worker(); control_props_changed(detail::Prop::CanSeek); }
+    void on_open_uri_async      ( auto &&fn) { set_fn(open_uri_async_fn,      fn); start_workers();                                               }
+
+    void set_async_workers(std::size_t threads, std::size_t queue_size)
+    {
+        worker_threads    = threads;
+        worker_queue_size = queue_size;
+    }
+
+    // In DispatchMode::Queued, method calls and property sets coming from
+    // clients are not handled on the event loop thread: they're pushed to a
+    // bounded queue and the on_* callbacks run only when drain_commands() is
+    // called. command_fd() becomes readable whenever commands are queued.
+    // OpenUri is always handled immediately. May be called while the loop
+    // runs, from the thread that drains the commands.
+    void set_dispatch_mode(DispatchMode mode);
+
+    // Limits PropertiesChanged signals for a property (e.g. "Volume") to one
+    // per interval. Changes arriving sooner are merged, and the last value is
+    // always sent once the interval has passed. An interval of 0 removes the
+    // limit, keeping the counts in throttle_stats(). Names of properties that never change on their own (Position,
+    // CanControl, Tracks) are ignored.
+    void set_throttle(std::string_view property, std::chrono::milliseconds interval);
+
+    ThrottleStats throttle_stats(std::string_view property)
+    {
+        std::lock_guard lock(pending_mutex);
+        auto p = detail::find_prop(property);
+        return p ? throttles[static_cast<int>(*p)].stats : ThrottleStats{};
+    }
+
+    int command_fd() const { return command_event_fd; }
+    // Pops the next queued command. It returns false only once the queue is
+    // empty and command_fd() has been reset, so call it until then.
+    bool poll_command(Command &cmd);
+    void run_command(const Command &cmd);
+    void drain_commands();
+
+    void set_fullscreen(bool value)                         { if (assign(fullscreen           , value)) prop_changed(detail::Prop::Fullscreen);          }
+    void set_identity(std::string_view value)               { if (assign(identity             , value)) prop_changed(detail::Prop::Identity);            }
+    void set_desktop_entry(std::string_view value)          { if (assign(desktop_entry        , value)) prop_changed(detail::Prop::DesktopEntry);        }
+    void set_supported_uri_schemes(const StringList &value) { if (assign(supported_uri_schemes, value)) prop_changed(detail::Prop::SupportedUriSchemes); }
+    void set_supported_mime_types(const StringList &value)  { if (assign(supported_mime_types , value)) prop_changed(detail::Prop::SupportedMimeTypes);  }
+    void set_loop_status(LoopStatus value)                  { if (assign(loop_status          , value)) prop_changed(detail::Prop::LoopStatus);          }
+    void set_shuffle(bool value)                            { if (assign(shuffle              , value)) prop_changed(detail::Prop::Shuffle);             }
+    void set_volume(double value)                           { if (assign(volume               , value)) prop_changed(detail::Prop::Volume);              }
+
+    void set_playback_status(PlaybackStatus value)
+    {
+        {
+            std::lock_guard lock(write_mutex);
+            if (!assign(playback_status, value))
+                return;
+            auto a = reanchor();
+            a.playing = value == PlaybackStatus::Playing;
+            anchor.store(a);
+        }
+        prop_changed(detail::Prop::PlaybackStatus);
+    }
+
+    // Re-anchors the position model. Only discontinuities need to be reported:
+    // while playing, the position advances on its own according to Rate, up to
+    // the track's Length. If the new value is further than the seek tolerance
+    // from the model's position, the Seeked signal is sent.
+    void set_position(int64_t value)
+    {
+        int64_t expected;
+        {
+            std::lock_guard lock(write_mutex);
+            auto a = reanchor();
+            expected = a.position;
+            a.position = std::max<int64_t>(value, 0);
+            anchor.store(a);
+            value = a.position;
+        }
+        if (std::abs(value - expected) > seek_tolerance)
+            send_seeked_signal(value);
+    }
+
+    void set_seek_tolerance(std::chrono::microseconds value) { seek_tolerance = value.count(); }
+
+    int64_t current_position() const { return anchor.load().at(std::chrono::steady_clock::now()); }
+
+    void set_rate(double value)
+    {
+        if (value == 0.0) {
+            fprintf(stderr, "warning: rate value must not be 0.0.\n");
+            return;
+        }
+        if (value < minimum_rate || value > maximum_rate) {
+            fprintf(stderr, "warning: rate value not in range.\n");
+            return;
+        }
+        {
+            std::lock_guard lock(write_mutex);
+            if (!assign(rate, value))
+                return;
+            auto a = reanchor();
+            a.rate = value;
+            anchor.store(a);
+        }
+        prop_changed(detail::Prop::Rate);
+    }
+
+    void set_metadata(const TrackMetadata &value)                      { edit_metadata([&] (TrackMetadata &m) { m = value; }); }
+    void update_metadata(const TrackMetadata &value)                   { edit_metadata([&] (TrackMetadata &m) { m.merge(value); }); }
+    void set_metadata_field(Field field, const sdbus::Variant &value)  { edit_metadata([&] (TrackMetadata &m) { m.set(field, value); }); }
+    void erase_metadata_field(Field field)                             { edit_metadata([&] (TrackMetadata &m) { m.erase(field); }); }
+    void set_metadata(const std::map<Field, sdbus::Variant> &value)    { set_metadata(TrackMetadata(value)); }
+    void update_metadata(const std::map<Field, sdbus::Variant> &value) { update_metadata(TrackMetadata(value)); }
+
+    template <Field F>
+    void set_metadata_field(field_type<F> value)
+    {
+        edit_metadata([&] (TrackMetadata &m) { m.template set<F>(std::move(value)); });
+    }
+
+    // Sets ArtUrl to an image stored through cache.
+    void set_art(ArtCache &cache, std::string_view image)       { if (auto u = cache.add(image); !u.empty())     set_metadata_field<Field::ArtUrl>(u); }
+    void set_art_file(ArtCache &cache, const std::string &path) { if (auto u = cache.add_file(path); !u.empty()) set_metadata_field<Field::ArtUrl>(u); }
+
+    void set_minimum_rate(double value)
+    {
+        if (value > 1.0) {
+            fprintf(stderr, "warning: minimum value should always be 1.0 or lower\n");
+            return;
+        }
+        if (assign(minimum_rate, value))
+            prop_changed(detail::Prop::MinimumRate);
+    }
+
+    void set_maximum_rate(double value)
+    {
+        if (value < 1.0) {
+            fprintf(stderr, "warning: maximum rate should always be 1.0 or higher\n");
+            return;
+        }
+        if (assign(maximum_rate, value))
+            prop_changed(detail::Prop::MaximumRate);
+    }
+
+    // TrackList interface. The first call to any of these makes HasTrackList
+    // true. Track ids are D-Bus object paths.
+    void add_track(std::string_view id, const std::map<Field, sdbus::Variant> &metadata, std::string_view after = NO_TRACK);
+    void remove_track(std::string_view id);
+    void set_track_metadata(std::string_view id, const std::map<Field, sdbus::Variant> &metadata);
+    void replace_tracks(const std::vector<std::pair<std::string, std::map<Field, sdbus::Variant>>> &tracks, std::string_view current);
+
+    // Playlists interface. Playlists are never stored by the server: they're
+    // requested from on_playlist_count()/on_playlist_at() one page at a time.
+    // Sorted orders are computed on first use and cached until
+    // playlists_changed() or playlist_changed() is called.
+    void set_playlist_orderings(const std::vector<PlaylistOrdering> &orderings);
+    void set_active_playlist(const std::optional<Playlist> &playlist);
+    void playlists_changed();
+    void playlist_changed(const Playlist &playlist);
+
+    // Returns the activity recorded so far. Always empty unless
+    // MPRIS_SERVER_METRICS is defined, in which case export_metrics() can
+    // also publish it on the METRICS interface.
+    Metrics metrics() const { return metrics_recorder.snapshot(); }
+    void export_metrics();
+
+    void send_seeked_signal(int64_t position);
+};
+
+// Binds a Server to an epoll instance owned by the caller. A typical loop:
+//
+//     mpris::EpollAdapter bus(server, epfd);
+//     for (;;) {
+//         int n = epoll_wait(epfd, events, N, bus.timeout());
+//         for (int i = 0; i < n; i++)
+//             if (!bus.owns(events[i]))
+//                 handle_own_event(events[i]);
+//         bus.dispatch();
+//     }
+//
+// timeout() must be called before every wait, since it also updates the
+// events watched on the bus fd.
+class EpollAdapter {
+    Server &server;
+    int epfd;
+    int fd          = -1;
+    int event_fd    = -1;
+    int wake_fd     = -1;
+    uint32_t events = 0;
+
+public:
+    EpollAdapter(Server &server, int epfd);
+    ~EpollAdapter();
+    EpollAdapter(const EpollAdapter &) = delete;
+    EpollAdapter &operator=(const EpollAdapter &) = delete;
+
+    int timeout();
+    bool owns(const epoll_event &event) const;
+    void dispatch() { server.process_pending(); }
+};
+
+// Hosts many players in one process, all dispatched by a single thread
+// through one epoll instance. Every player still has its own bus
+// connection; a connection is only woken up when it has something to do.
+// Callbacks run on the dispatch thread and must not add or remove players.
+class ServerPool {
+    struct Entry {
+        std::unique_ptr<Server> server;
+        std::unique_ptr<EpollAdapter> adapter;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    std::unordered_map<const EpollAdapter *, Entry> entries;
+    std::mutex mutex;
+    int epfd    = -1;
+    int wake_fd = -1;
+    std::thread thread;
+    std::atomic<bool> running = false;
+
+    void run();
+    void wake();
+    void dispatch(Entry &entry);
+
+public:
+    ServerPool();
+    ~ServerPool();
+    ServerPool(const ServerPool &) = delete;
+    ServerPool &operator=(const ServerPool &) = delete;
+
+    // Creates a player and starts dispatching it. setup runs before that, so
+    // it's the place to register callbacks with on_*. Returns nullptr if the
+    // connection or the bus name can't be acquired; the player lives until
+    // remove() or the pool's destruction.
+    Server *add(std::string_view name, const std::function<void(Server &)> &setup = {});
+    Server *add(std::string_view name, std::unique_ptr<sdbus::IConnection> connection,
+                const std::function<void(Server &)> &setup = {});
+    void remove(Server *server);
+    std::size_t size();
+
+    void start();
+    void stop();
+};
+
+// A player as last announced on the bus, kept by Client.
+struct PlayerState {
+    std::string name; // without PREFIX
+    std::string identity;
+    std::string desktop_entry;
+    StringList supported_uri_schemes;
+    StringList supported_mime_types;
+    bool can_quit           = false;
+    bool can_raise          = false;
+    bool can_set_fullscreen = false;
+    bool fullscreen         = false;
+    bool has_track_list     = false;
+    PlaybackStatus playback_status = PlaybackStatus::Stopped;
+    LoopStatus loop_status         = LoopStatus::None;
+    double rate                    = 1.0;
+    bool shuffle                   = false;
+    TrackMetadata metadata;
+    double volume                  = 0.0;
+    double minimum_rate            = 1.0;
+    double maximum_rate            = 1.0;
+    bool can_go_next               = false;
+    bool can_go_previous           = false;
+    bool can_play                  = false;
+    bool can_pause                 = false;
+    bool can_seek                  = false;
+    bool can_control               = false;
+    detail::PositionAnchor anchor  {};
+
+    // extrapolated from the last known position, Rate and PlaybackStatus
+    int64_t position() const { return anchor.at(std::chrono::steady_clock::now()); }
+};
+
+// Watches every MPRIS player on the bus. A player's properties are read once
+// when it appears and then kept up to date from PropertiesChanged and
+// Seeked alone, so reading them is a memory lookup. Callbacks run on the
+// event loop thread and should be registered before starting it; players
+// already on the bus are announced when the loop starts.
+class Client {
+    struct Player {
+        std::unique_ptr<sdbus::IProxy> proxy;
+        std::shared_ptr<const PlayerState> state;
+        int pending = 2; // GetAll replies still expected
+    };
+
+    std::unique_ptr<sdbus::IConnection> connection;
+    std::unique_ptr<sdbus::IProxy> bus;
+    sdbus::Slot name_owner_match;
+    std::map<std::string, Player, std::less<>> players_;
+    mutable std::mutex mutex;
+
+    std::function<void(const PlayerState &)>                     player_added_fn;
+    std::function<void(std::string_view)>                        player_removed_fn;
+    std::function<void(const PlayerState &, const StringList &)> properties_changed_fn;
+    std::function<void(const PlayerState &)>                     seeked_fn;
+
+    void discover();
+    void name_owner_changed(const std::string &service, const std::string &old_owner, const std::string &new_owner);
+    void add_player(const std::string &name);
+    void remove_player(const std::string &name);
+    void fetch(const std::string &name, const std::string &interface);
+    void properties_changed(const std::string &name, const std::map<std::string, sdbus::Variant> &changed,
+                            const StringList &invalidated);
+    std::shared_ptr<const PlayerState> update(std::string_view name, const std::function<void(PlayerState &)> &fn);
+    static void apply(PlayerState &state, const std::string &property, const sdbus::Variant &value);
+
+public:
+    Client();
+    explicit Client(std::unique_ptr<sdbus::IConnection> connection);
+    ~Client();
+    Client(const Client &) = delete;
+    Client &operator=(const Client &) = delete;
+
+    // names without PREFIX
+    std::vector<std::string> players() const;
+    // nullptr if no such player is known
+    std::shared_ptr<const PlayerState> player(std::string_view name) const;
+
+    void on_player_added       (auto &&fn) { player_added_fn       = fn; }
+    void on_player_removed     (auto &&fn) { player_removed_fn     = fn; }
+    void on_properties_changed (auto &&fn) { properties_changed_fn = fn; }
+    void on_seeked             (auto &&fn) { seeked_fn             = fn; }
+
+    void start_loop();
+    void start_loop_async();
+    void stop();
+};
+
+#ifndef MPRIS_SERVER_NO_IMPL
+
+// Sends those of the given Can* properties that are now true; without
+// arguments, all of CanGoNext, CanGoPrevious, CanPause, CanPlay and CanSeek.
+inline void Server::control_props_changed(auto... props)
+{
+    using detail::Prop;
+    if constexpr (sizeof...(props) == 0) {
+        control_props_changed(Prop::CanGoNext, Prop::CanGoPrevious, Prop::CanPause, Prop::CanPlay, Prop::CanSeek);
+    } else {
+        auto f = [&] (Prop p) {
+            switch (p) {
+            case Prop::CanGoNext:     return can_go_next();
+            case Prop::CanGoPrevious: return can_go_previous();
+            case Prop::CanPause:      return can_pause();
+            case Prop::CanPlay:       return can_play();
+            case Prop::CanSeek:       return can_seek();
+            default:                  return false;
+            }
+        };
+        detail::PropMask m = 0;
+        ((m |= f(props) ? detail::prop_bit(props) : 0), ...);
+        if (m != 0)
+            emit_props(m);
+        else
+            refresh_props((detail::prop_bit(props) | ...));
+    }
+}
+
+inline detail::RootProps Server::make_root_props() const
+{
+    return { identity.load(), desktop_entry.load(), supported_uri_schemes.load(), supported_mime_types.load(),
+             bool(quit_fn), bool(raise_fn), bool(fullscreen_changed_fn), has_track_list() };
+}
+
+inline detail::PlayerProps Server::make_player_props() const
+{
+    return { metadata.load(), can_go_next(), can_go_previous(), can_play(), can_pause(), can_seek(), can_control() };
+}
+
+// Rebuilds the views containing any of props from the current values.
+inline void Server::refresh_props(detail::PropMask props)
+{
+    std::lock_guard lock(props_mutex);
+    if (props & detail::root_view_props)
+        root_props.store(make_root_props());
+    if (props & detail::player_view_props)
+        player_props.store(make_player_props());
+}
+
+// The view returned stays valid until the next call on the same thread, which
+// is long enough for a getter to serialize from it.
+inline const detail::RootProps &Server::root_view() const
+{
+    thread_local std::shared_ptr<const detail::RootProps> hold;
+    hold = root_props.load();
+    return *hold;
+}
+
+inline const detail::PlayerProps &Server::player_view() const
+{
+    thread_local std::shared_ptr<const detail::PlayerProps> hold;
+    hold = player_props.load();
+    return *hold;
+}
+
+inline void Server::emit_props(detail::PropMask props)
+{
+    if (props & (detail::root_view_props | detail::player_view_props))
+        refresh_props(props);
+    std::lock_guard lock(pending_mutex);
+    if (props & throttled) {
+        auto now = std::chrono::steady_clock::now();
+        for (auto m = props & throttled; m != 0; m &= m - 1) {
+            auto p = static_cast<detail::Prop>(std::countr_zero(m));
+            if (throttle(p, now))
+                props &= ~detail::prop_bit(p);
+        }
+    }
+    if (props == 0)
+        return;
+    if (batch_depth > 0) {
+        metrics_recorder.coalesce(std::popcount(props));
+        pending |= props;
+        return;
+    }
+    send_props(props);
+}
+
+// Writes one PropertiesChanged signal per interface straight into the
+// message, reading the current value of each property.
+inline void Server::send_props(detail::PropMask props)
+{
+    if (!ready)
+        return;
+    for (std::size_t i = 0; i < std::size(interfaces); i++) {
+        auto m = props & detail::interface_props[i];
+        if (m == 0)
+            continue;
+        metrics_recorder.signal();
+        auto signal = object->createSignal(PROPS.c_str(), "PropertiesChanged");
+        signal << interfaces[i]->c_str();
+        signal.openContainer("{sv}");
+        for (; m != 0; m &= m - 1) {
+            auto p = static_cast<detail::Prop>(std::countr_zero(m));
+            const auto &info = detail::prop_table[static_cast<int>(p)];
+            signal.openDictEntry("sv");
+            signal << info.name;
+            signal.openVariant(info.signature);
+            write_prop(p, signal);
+            signal.closeVariant();
+            signal.closeDictEntry();
+        }
+        signal.closeContainer();
+        signal.openContainer("s");
+        signal.closeContainer();
+        object->emitSignal(signal);
+    }
+}
+
+inline void Server::write_prop(detail::Prop prop, sdbus::Message &msg)
+{
+    using detail::Prop;
+    switch (prop) {
+    case Prop::CanQuit:             msg << bool(quit_fn);                                       break;
+    case Prop::CanRaise:            msg << bool(raise_fn);                                      break;
+    case Prop::CanSetFullscreen:    msg << bool(fullscreen_changed_fn);                         break;
+    case Prop::Fullscreen:          msg << fullscreen.load();                                   break;
+    case Prop::HasTrackList:        msg << has_track_list();                                    break;
+    case Prop::Identity:            msg << *identity.load();                                    break;
+    case Prop::DesktopEntry:        msg << *desktop_entry.load();                               break;
+    case Prop::SupportedUriSchemes: msg << *supported_uri_schemes.load();                       break;
+    case Prop::SupportedMimeTypes:  msg << *supported_mime_types.load();                        break;
+    case Prop::PlaybackStatus:      msg << detail::playback_status_to_string(playback_status);  break;
+    case Prop::LoopStatus:          msg << detail::loop_status_to_string(loop_status);          break;
+    case Prop::Rate:                msg << rate.load();                                         break;
+    case Prop::Shuffle:             msg << shuffle.load();                                      break;
+    case Prop::Metadata:            msg << *metadata.load();                                    break;
+    case Prop::Volume:              msg << volume.load();                                       break;
+    case Prop::MinimumRate:         msg << minimum_rate.load();                                 break;
+    case Prop::MaximumRate:         msg << maximum_rate.load();                                 break;
+    case Prop::CanGoNext:           msg << can_go_next();                                       break;
+    case Prop::CanGoPrevious:       msg << can_go_previous();                                   break;
+    case Prop::CanPlay:             msg << can_play();                                          break;
+    case Prop::CanPause:            msg << can_pause();                                         break;
+    case Prop::CanSeek:             msg << can_seek();                                          break;
+    case Prop::CanEditTracks:       msg << can_edit_tracks();                                   break;
+    case Prop::PlaylistCount:       msg << playlist_count();                                    break;
+    case Prop::Orderings:           msg << get_playlist_orderings();                            break;
+    case Prop::ActivePlaylist:      msg << get_active_playlist();                               break;
+    }
+}
+
+// Returns true if the change has been held back. Must be called with
+// pending_mutex held.
+inline bool Server::throttle(detail::Prop prop, std::chrono::steady_clock::time_point now)
+{
+    auto &t = throttles[static_cast<int>(prop)];
+    if (!t.pending && now - t.last >= t.interval) {
+        t.last = now;
+        t.stats.emitted++;
+        return false;
+    }
+    if (!t.pending && external_loop) {
+        // the loop may be waiting with no timeout at all
+        uint64_t one = 1;
+        [[maybe_unused]] auto r = write(throttle_event_fd, &one, sizeof(one));
+    }
+    t.pending = true;
+    t.stats.coalesced++;
+    metrics_recorder.coalesce();
+    throttle_cv.notify_one();
+    return true;
+}
+
+inline void Server::throttle_loop()
+{
+    std::unique_lock lock(pending_mutex);
+    while (!stopping) {
+        auto next = flush_throttles(std::chrono::steady_clock::now());
+        if (next == std::chrono::steady_clock::time_point::max())
+            throttle_cv.wait(lock);
+        else
+            throttle_cv.wait_until(lock, next);
+    }
+}
+
+// Sends the throttled changes that are due and returns when the next one
+// will be. Must be called with pending_mutex held.
+inline std::chrono::steady_clock::time_point Server::flush_throttles(std::chrono::steady_clock::time_point now)
+{
+    auto next = std::chrono::steady_clock::time_point::max();
+    detail::PropMask due = 0;
+    for (auto m = throttled; m != 0; m &= m - 1) {
+        auto i = std::countr_zero(m);
+        auto &t = throttles[i];
+        if (!t.pending)
+            continue;
+        if (t.last + t.interval <= now) {
+            due |= detail::PropMask(1) << i;
+            t.pending = false;
+            t.last = now;
+            t.stats.emitted++;
+        } else
+            next = std::min(next, t.last + t.interval);
+    }
+    if (due != 0)
+        send_props(due);
+    return next;
+}
+
+inline void Server::stop_throttle_thread()
+{
+    if (!throttle_thread.joinable())
+        return;
+    {
+        std::lock_guard lock(pending_mutex);
+        stopping = true;
+    }
+    throttle_cv.notify_one();
+    throttle_thread.join();
+    std::lock_guard lock(pending_mutex);
+    stopping = false;
+}
+
+inline void Server::set_throttle(std::string_view property, std::chrono::milliseconds interval)
+{
+    auto p = detail::find_prop(property);
+    if (!p)
+        return;
+    std::lock_guard lock(pending_mutex);
+    auto &t = throttles[static_cast<int>(*p)];
+    if (interval.count() == 0) {
+        if (t.pending) {
+            send_props(detail::prop_bit(*p));
+            t.stats.emitted++;
+        }
+        t.interval = {};
+        t.last     = {};
+        t.pending  = false;
+        throttled &= ~detail::prop_bit(*p);
+        return;
+    }
+    t.interval = interval;
+    throttled |= detail::prop_bit(*p);
+    if (!external_loop && !throttle_thread.joinable())
+        throttle_thread = std::thread([this] { throttle_loop(); });
+}
+
+inline void Server::begin_update()
+{
+    std::lock_guard lock(pending_mutex);
+    batch_depth++;
+}
+
+inline void Server::commit()
+{
+    std::lock_guard lock(pending_mutex);
+    if (batch_depth == 0 || --batch_depth > 0)
+        return;
+    auto p = pending;
+    pending = 0;
+    if (p != 0)
+        send_props(p);
+}
+
+inline void Server::set_fullscreen_external(bool value)
+{
+    if (!fullscreen_changed_fn)
+        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Cannot set Fullscreen (CanSetFullscreen is false).");
+    invoke({ .type = Command::Type::SetFullscreen, .flag = value }, [&] { set_fullscreen(value); });
+}
+
+inline void Server::set_loop_status_external(const std::string &value)
+{
+    for (auto i = 0u; i < std::size(loop_status_strings); i++) {
+        if (value == loop_status_strings[i]) {
+            if (!can_control())
+                throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Cannot set loop status (CanControl is false).");
+            invoke({ .type = Command::Type::SetLoopStatus, .loop_status = static_cast<LoopStatus>(i) },
+                   [&] { set_loop_status(static_cast<LoopStatus>(i)); });
+        }
+    }
+}
+
+inline void Server::set_rate_external(double value)
+{
+    if (value <= minimum_rate || value > maximum_rate)
+        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Rate value not in range.");
+    if (value == 0.0)
+        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Rate value must not be 0.0.");
+    invoke({ .type = Command::Type::SetRate, .value = value }, [&] { set_rate(value); });
+}
+
+inline void Server::set_shuffle_external(bool value)
+{
+    if (!can_control())
+        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Cannot set shuffle (CanControl is false).");
+    invoke({ .type = Command::Type::SetShuffle, .flag = value }, [&] { set_shuffle(value); });
+}
+
+inline void Server::set_volume_external(double value)
+{
+    if (!can_control())
+        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Cannot set volume (CanControl is false).");
+    invoke({ .type = Command::Type::SetVolume, .value = value }, [&] { set_volume(value); });
+}
+
+inline bool Server::is_current_track(const sdbus::ObjectPath &id) const
+{
+    auto m = metadata.load();
+    const auto &tid = m->value(Field::TrackId);
+    if (auto path = std::get_if<sdbus::ObjectPath>(&tid))
+        return *path == id;
+    auto untyped = std::get_if<sdbus::Variant>(&tid);
+    if (!untyped || untyped->isEmpty())
+        return false;
+    std::string_view type = untyped->peekValueType();
+    return type == "o" ? untyped->get<sdbus::ObjectPath>() == id
+         : type == "s" ? untyped->get<std::string>()       == id
+         :               false;
+}
+
+inline void Server::seek_method(sdbus::Result<> &&result, int64_t offset)
+{
+    if (can_seek() && seek_async_fn && dispatch_mode.load(std::memory_order_acquire) == DispatchMode::Immediate) {
+        run_async(seek_worker.get(), std::move(result), [this, offset] { seek_async_fn(offset); });
+        return;
+    }
+    reply(std::move(result), [&] {
+        if (can_seek())
+            invoke({ .type = Command::Type::Seek, .position = offset });
+    });
+}
+
+inline void Server::set_position_method(sdbus::Result<> &&result, sdbus::ObjectPath id, int64_t pos)
+{
+    if (!can_seek() || !is_current_track(id)) {
+        result.returnResults();
+        return;
+    }
+    if (set_position_async_fn && dispatch_mode.load(std::memory_order_acquire) == DispatchMode::Immediate) {
+        run_async(seek_worker.get(), std::move(result), [this, pos] { set_position_async_fn(pos); });
+        return;
+    }
+    reply(std::move(result), [&] { invoke({ .type = Command::Type::SetPosition, .position = pos }); });
+}
+
+inline void Server::open_uri(sdbus::Result<> &&result, const std::string &uri)
+{
+    if (open_uri_async_fn) {
+        run_async(workers.get(), std::move(result), [this, uri] { open_uri_async_fn(uri); });
+        return;
+    }
+    reply(std::move(result), [&] {
+        if (open_uri_fn)
+            open_uri_fn(uri);
+    });
+}
+
+inline void Server::reply(sdbus::Result<> &&result, const std::function<void()> &fn)
+{
+    try {
+        fn();
+    } catch (const sdbus::Error &error) {
+        result.returnError(error);
+        return;
+    }
+    result.returnResults();
+}
+
+// Runs job on pool and replies once it's done.
+inline void Server::run_async(detail::WorkerPool *pool, sdbus::Result<> &&result, std::function<void()> job)
+{
+    auto r = std::make_shared<sdbus::Result<>>(std::move(result));
+    auto queued = pool && pool->submit([this, r, job = std::move(job)] {
+        try {
+            job();
+        } catch (const sdbus::Error &error) {
+            r->returnError(error);
+            return;
+        } catch (const std::exception &e) {
+            r->returnError(sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, e.what()));
+            return;
+        }
+        r->returnResults();
+    });
+    if (!queued)
+        r->returnError(sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Too many requests in progress."));
+}
+
+// Runs cmd, or queues it in DispatchMode::Queued. accepted is called once
+// the command can no longer be rejected, before the player's callback sees
+// it, so that a property set refused with an error leaves no trace.
+inline void Server::invoke(const Command &cmd, const std::function<void()> &accepted)
+{
+    if (dispatch_mode.load(std::memory_order_acquire) == DispatchMode::Immediate) {
+        if (accepted)
+            accepted();
+        run_command(cmd);
+        return;
+    }
+    // the event loop thread is the only producer, so the push can't fail
+    // once there's room
+    if (commands->full())
+        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Command queue is full.");
+    if (accepted)
+        accepted();
+    commands->push(cmd);
+    uint64_t one = 1;
+    [[maybe_unused]] auto r = write(command_event_fd, &one, sizeof(one));
+    if (command_queued_fn)
+        command_queued_fn();
+}
+
+inline void Server::run_command(const Command &cmd)
+{
+    switch (cmd.type) {
+    case Command::Type::Quit:          if (quit_fn)                quit_fn();                                 break;
+    case Command::Type::Raise:         if (raise_fn)               raise_fn();                                break;
+    case Command::Type::Next:          if (next_fn)                next_fn();                                 break;
+    case Command::Type::Previous:      if (previous_fn)            previous_fn();                             break;
+    case Command::Type::Pause:         if (pause_fn)               pause_fn();                                break;
+    case Command::Type::PlayPause:     if (play_pause_fn)          play_pause_fn();                           break;
+    case Command::Type::Stop:          if (stop_fn)                stop_fn();                                 break;
+    case Command::Type::Play:          if (play_fn)                play_fn();                                 break;
+    case Command::Type::Seek:          if (auto &f = seek_fn         ? seek_fn         : seek_async_fn)         f(cmd.position); break;
+    case Command::Type::SetPosition:   if (auto &f = set_position_fn ? set_position_fn : set_position_async_fn) f(cmd.position); break;
+    case Command::Type::SetFullscreen: if (fullscreen_changed_fn)  fullscreen_changed_fn(cmd.flag);           break;
+    case Command::Type::SetLoopStatus: if (loop_status_changed_fn) loop_status_changed_fn(cmd.loop_status);   break;
+    case Command::Type::SetRate:       if (rate_changed_fn)        rate_changed_fn(cmd.value);                break;
+    case Command::Type::SetShuffle:    if (shuffle_changed_fn)     shuffle_changed_fn(cmd.flag);              break;
+    case Command::Type::SetVolume:     if (volume_changed_fn)      volume_changed_fn(cmd.value);              break;
+    }
+}
+
+inline void Server::set_dispatch_mode(DispatchMode mode)
+{
+    if (mode == DispatchMode::Queued && !commands) {
+        commands = std::make_unique<detail::SpscQueue<Command, 256>>();
+        command_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    // published after the queue, which the loop thread uses once it sees Queued
+    dispatch_mode.store(mode, std::memory_order_release);
+}
+
+inline bool Server::poll_command(Command &cmd)
+{
+    if (!commands)
+        return false;
+    if (commands->pop(cmd))
+        return true;
+    // reset before looking again, so that a command pushed in between
+    // isn't left without a notification
+    uint64_t n;
+    [[maybe_unused]] auto r = read(command_event_fd, &n, sizeof(n));
+    return commands->pop(cmd);
+}
+
+inline void Server::drain_commands()
+{
+    if (!commands)
+        return;
+    // reset the notification first, so that a command pushed while draining
+    // makes the fd readable again
+    uint64_t n;
+    [[maybe_unused]] auto r = read(command_event_fd, &n, sizeof(n));
+    Command cmd;
+    while (commands->pop(cmd))
+        run_command(cmd);
+}
+
+// must be called with tracklist_mutex held
+inline detail::TrackList &Server::tracks()
+{
+    if (!tracklist) {
+        tracklist = std::make_unique<detail::TrackList>();
+        tracklist_created = true;
+        prop_changed(detail::Prop::HasTrackList);
+    }
+    return *tracklist;
+}
+
+// What is sent for a track. TrackId defaults to the track's own id.
+inline TrackMetadata Server::track_metadata(const detail::TrackList::Track &track)
+{
+    TrackMetadata m;
+    track.for_each_field([&] (Field f, const detail::FieldValue &v) { m.set_value(f, v); });
+    if (!m.has(Field::TrackId))
+        m.set<Field::TrackId>(sdbus::ObjectPath(*track.id));
+    return m;
+}
+
+inline std::vector<TrackMetadata> Server::get_tracks_metadata(const std::vector<sdbus::ObjectPath> &ids)
+{
+    std::lock_guard lock(tracklist_mutex);
+    std::vector<TrackMetadata> r;
+    if (!tracklist)
+        return r;
+    r.reserve(ids.size());
+    for (const auto &id : ids)
+        if (auto t = tracklist->find(id))
+            r.push_back(track_metadata(*t));
+    return r;
+}
+
+inline void Server::add_track_method(const std::string &uri, sdbus::ObjectPath after, bool set_as_current)
+{
+    if (can_edit_tracks())
+        add_track_fn(uri, after, set_as_current);
+}
+
+inline void Server::remove_track_method(sdbus::ObjectPath id)
+{
+    if (can_edit_tracks())
+        remove_track_fn(id);
+}
+
+inline void Server::go_to_method(sdbus::ObjectPath id)
+{
+    {
+        std::lock_guard lock(tracklist_mutex);
+        if (!tracklist || !tracklist->find(id))
+            return;
+    }
+    if (go_to_fn)
+        go_to_fn(id);
+}
+
+inline std::vector<sdbus::ObjectPath> Server::track_ids()
+{
+    std::lock_guard lock(tracklist_mutex);
+    std::vector<sdbus::ObjectPath> r;
+    if (!tracklist)
+        return r;
+    r.reserve(tracklist->size());
+    tracklist->for_each([&] (const auto &t) { r.emplace_back(*t.id); });
+    return r;
+}
+
+inline void Server::add_track(std::string_view id, const std::map<Field, sdbus::Variant> &metadata, std::string_view after)
+{
+    std::lock_guard lock(tracklist_mutex);
+    auto &t = tracks();
+    auto prev = t.insert(id, metadata, after);
+    if (!prev || !ready)
+        return;
+    metrics_recorder.signal();
+    object->emitSignal("TrackAdded").onInterface(MP2TL)
+        .withArguments(track_metadata(*t.find(id)), sdbus::ObjectPath(std::string(*prev)));
+}
+
+inline void Server::remove_track(std::string_view id)
+{
+    std::lock_guard lock(tracklist_mutex);
+    if (!tracks().erase(id) || !ready)
+        return;
+    metrics_recorder.signal();
+    object->emitSignal("TrackRemoved").onInterface(MP2TL).withArguments(sdbus::ObjectPath(std::string(id)));
+}
+
+inline void Server::set_track_metadata(std::string_view id, const std::map<Field, sdbus::Variant> &metadata)
+{
+    std::lock_guard lock(tracklist_mutex);
+    auto &t = tracks();
+    if (!t.set_metadata(id, metadata) || !ready)
+        return;
+    metrics_recorder.signal();
+    object->emitSignal("TrackMetadataChanged").onInterface(MP2TL)
+        .withArguments(sdbus::ObjectPath(std::string(id)), track_metadata(*t.find(id)));
+}
+
+inline void Server::replace_tracks(const std::vector<std::pair<std::string, std::map<Field, sdbus::Variant>>> &tracks,
+                                   std::string_view current)
+{
+    std::lock_guard lock(tracklist_mutex);
+    auto &t = this->tracks();
+    t.clear();
+    std::vector<sdbus::ObjectPath> ids;
+    ids.reserve(tracks.size());
+    std::string_view last = NO_TRACK;
+    for (const auto &[id, metadata] : tracks) {
+        if (!t.insert(id, metadata, last))
+            continue;
+        ids.emplace_back(id);
+        last = id;
+    }
+    if (!ready)
+        return;
+    metrics_recorder.signal(2);
+    object->emitSignal("TrackListReplaced").onInterface(MP2TL).withArguments(ids, sdbus::ObjectPath(std::string(current.empty() ? NO_TRACK : current)));
+    object->emitSignal("PropertiesChanged").onInterface(PROPS).withArguments(MP2TL, Metadata{}, std::vector<std::string>{"Tracks"});
+}
+
+// must be called with playlists_mutex held
+inline const std::vector<uint32_t> &Server::playlist_order(PlaylistOrdering order)
+{
+    if (auto it = playlist_orders.find(order); it != playlist_orders.end())
+        return it->second;
+    auto n = playlist_count();
+    std::vector<std::pair<std::variant<std::string, int64_t>, uint32_t>> keys;
+    keys.reserve(n);
+    for (uint32_t i = 0; i < n; i++) {
+        auto p = playlist_at_fn(i);
+        switch (order) {
+        case PlaylistOrdering::Alphabetical: keys.emplace_back(std::move(p.name), i); break;
+        case PlaylistOrdering::CreationDate: keys.emplace_back(p.created,         i); break;
+        case PlaylistOrdering::ModifiedDate: keys.emplace_back(p.modified,        i); break;
+        case PlaylistOrdering::LastPlayDate: keys.emplace_back(p.last_played,     i); break;
+        case PlaylistOrdering::UserDefined:  keys.emplace_back(int64_t(i),        i); break;
+        }
+    }
+    std::stable_sort(keys.begin(), keys.end(), [] (const auto &a, const auto &b) { return a.first < b.first; });
+    std::vector<uint32_t> perm;
+    perm.reserve(n);
+    for (const auto &k : keys)
+        perm.push_back(k.second);
+    // only cached once complete, in case playlist_at_fn threw
+    return playlist_orders.emplace(order, std::move(perm)).first->second;
+}
+
+inline std::vector<detail::DBusPlaylist> Server::get_playlists(uint32_t index, uint32_t max_count, const std::string &order, bool reverse)
+{
+    auto o = std::find(std::begin(playlist_ordering_strings), std::end(playlist_ordering_strings), order);
+    if (o == std::end(playlist_ordering_strings))
+        throw sdbus::Error(sdbus::Error::Name{service_name + ".Error"}, "Unknown playlist ordering.");
+    auto ordering = static_cast<PlaylistOrdering>(o - std::begin(playlist_ordering_strings));
+    std::vector<detail::DBusPlaylist> r;
+    if (!playlist_at_fn)
+        return r;
+    std::lock_guard lock(playlists_mutex);
+    const auto *perm = ordering == PlaylistOrdering::UserDefined ? nullptr : &playlist_order(ordering);
+    // the count may have changed since the permutation was cached, until
+    // playlists_changed() is called
+    uint32_t n = perm ? perm->size() : playlist_count();
+    if (index >= n)
+        return r;
+    auto count = std::min(max_count, n - index);
+    r.reserve(count);
+    for (uint32_t i = index; i < index + count; i++) {
+        auto k = reverse ? n - 1 - i : i;
+        auto p = playlist_at_fn(perm ? (*perm)[k] : k);
+        r.emplace_back(sdbus::ObjectPath(std::move(p.id)), std::move(p.name), std::move(p.icon));
+    }
+    return r;
+}
+
+inline void Server::activate_playlist_method(sdbus::ObjectPath id)
+{
+    if (activate_playlist_fn)
+        activate_playlist_fn(id);
+}
+
+inline StringList Server::get_playlist_orderings()
+{
+    std::lock_guard lock(playlists_mutex);
+    StringList r;
+    for (auto o : playlist_orderings)
+        r.push_back(playlist_ordering_strings[static_cast<int>(o)]);
+    return r;
+}
+
+inline sdbus::Struct<bool, detail::DBusPlaylist> Server::get_active_playlist()
+{
+    std::lock_guard lock(playlists_mutex);
+    if (!active_playlist)
+        return { false, detail::DBusPlaylist{ sdbus::ObjectPath("/"), "", "" } };
+    return { true, detail::DBusPlaylist{ sdbus::ObjectPath(active_playlist->id), active_playlist->name, active_playlist->icon } };
+}
+
+inline void Server::set_playlist_orderings(const std::vector<PlaylistOrdering> &orderings)
+{
+    {
+        std::lock_guard lock(playlists_mutex);
+        playlist_orderings = orderings;
+    }
+    prop_changed(detail::Prop::Orderings);
+}
+
+inline void Server::set_active_playlist(const std::optional<Playlist> &playlist)
+{
+    {
+        std::lock_guard lock(playlists_mutex);
+        active_playlist = playlist;
+    }
+    prop_changed(detail::Prop::ActivePlaylist);
+}
+
+inline void Server::playlists_changed()
+{
+    {
+        std::lock_guard lock(playlists_mutex);
+        playlist_orders.clear();
+    }
+    prop_changed(detail::Prop::PlaylistCount);
+}
+
+inline void Server::playlist_changed(const Playlist &playlist)
+{
+    {
+        std::lock_guard lock(playlists_mutex);
+        playlist_orders.clear();
+        if (active_playlist && active_playlist->id == playlist.id)
+            active_playlist = playlist;
+    }
+    if (!ready)
+        return;
+    metrics_recorder.signal();
+    object->emitSignal("PlaylistChanged").onInterface(MP2PL)
+        .withArguments(detail::DBusPlaylist{ sdbus::ObjectPath(playlist.id), playlist.name, playlist.icon });
+}
+
+template <typename F>
+auto Server::instrument(const char *member, F &&fn)
+{
+#ifdef MPRIS_SERVER_METRICS
+    return instrument_fn(member, std::function(std::forward<F>(fn)));
+#else
+    return std::forward<F>(fn);
+#endif
+}
+
+template <typename R, typename... Args>
+std::function<R(Args...)> Server::instrument_fn(const char *member, std::function<R(Args...)> fn)
+{
+    return [this, member, fn = std::move(fn)] (Args... args) -> R {
+        struct Record {
+            Server *server;
+            const char *member;
+            std::chrono::steady_clock::time_point start;
+            ~Record()
+            {
+                auto sender = server->object->getCurrentlyProcessedMessage().getSender();
+                server->metrics_recorder.call(member, sender ? sender : "", std::chrono::steady_clock::now() - start);
+            }
+        } record { this, member, std::chrono::steady_clock::now() };
+        return fn(std::forward<Args>(args)...);
+    };
+}
+
+inline void Server::export_metrics()
+{
+#ifdef MPRIS_SERVER_METRICS
+    object->addVTable(sdbus::registerMethod("GetLatencyHistogram").implementedAs([this] (const std::string &member) {
+                            auto m = metrics();
+                            auto it = m.members.find(member);
+                            return it == m.members.end() ? std::vector<uint64_t>{}
+                                 : std::vector<uint64_t>(it->second.latency_histogram.begin(), it->second.latency_histogram.end());
+                        }).withInputParamNames("Member").withOutputParamNames("Histogram")
+                    , sdbus::registerProperty("Calls")           .withGetter([this] {
+                            std::map<std::string, uint64_t> r;
+                            for (const auto &[k, v] : metrics().members)
+                                r.emplace(k, v.calls);
+                            return r;
+                        })
+                    , sdbus::registerProperty("Callers")         .withGetter([this] {
+                            auto c = metrics().callers;
+                            return std::map<std::string, uint64_t>(c.begin(), c.end());
+                        })
+                    , sdbus::registerProperty("SignalsEmitted")  .withGetter([this] { return metrics().signals_emitted; })
+                    , sdbus::registerProperty("SignalsCoalesced").withGetter([this] { return metrics().signals_coalesced; })
+                    ).forInterface(METRICS);
+#endif
+}
+
+inline std::unique_ptr<Server> Server::make(std::string_view name)
+{
+    try {
+        auto s = std::make_unique<Server>(name);
+        return s;
+    } catch (const sdbus::Error &error) {
+        return nullptr;
+    }
+}
+
+inline std::unique_ptr<Server> Server::make(std::string_view name, std::unique_ptr<sdbus::IConnection> connection)
+{
+    try {
+        return std::make_unique<Server>(name, std::move(connection));
+    } catch (const sdbus::Error &error) {
+        return nullptr;
+    }
+}
+
+inline Server::Server(std::string_view name)
+    : Server(name, sdbus::createSessionBusConnection())
+{
+}
+
+inline Server::Server(std::string_view name, std::unique_ptr<sdbus::IConnection> conn)
+    : service_name(PREFIX + std::string(name)), connection(std::move(conn))
+{
+    register_object();
+    connection->requestName(sdbus::ServiceName{service_name});
+    ready = true;
+}
+
+inline std::unique_ptr<Server> Server::make_async(std::string_view name, std::function<void(const StartResult &)> on_ready)
+{
+    auto s = std::unique_ptr<Server>(new Server(name, Deferred{}));
+    s->connect_async(std::move(on_ready));
+    return s;
+}
+
+// The object is registered before the name is requested, so that clients
+// never see the name without the interfaces behind it.
+inline void Server::connect_async(std::function<void(const StartResult &)> on_ready)
+{
+    connect_thread = std::thread([this, on_ready = std::move(on_ready)] {
+        StartResult r;
+        try {
+            connection = sdbus::createSessionBusConnection();
+            register_object();
+            auto name = service_name;
+            try {
+                connection->requestName(sdbus::ServiceName{name});
+            } catch (const sdbus::Error &) {
+                name += ".instance" + std::to_string(getpid());
+                connection->requestName(sdbus::ServiceName{name});
+            }
+            service_name = name;
+            r = { .ok = true, .bus_name = name, .error = {} };
+        } catch (const sdbus::Error &error) {
+            r = { .ok = false, .bus_name = {}, .error = error.getMessage() };
+        } catch (const std::exception &error) {
+            r = { .ok = false, .bus_name = {}, .error = error.what() };
+        }
+        if (r.ok) {
+            std::lock_guard lock(start_mutex);
+            ready = true;
+            if (loop_requested)
+                connection->enterEventLoopAsync();
+        }
+        if (on_ready)
+            on_ready(r);
+    });
+}
+
+inline void Server::register_object()
+{
+    object = sdbus::createObject(*connection, sdbus::ObjectPath{OBJECT_PATH});
+    refresh_props(detail::root_view_props | detail::player_view_props);
+
+#define M(f)       detail::member_fn(this, &Server::f)
+#define I(name, f) instrument(name, f)
+    object->addVTable(sdbus::registerMethod("Raise").implementedAs(I("Raise", [&] { invoke({ .type = Command::Type::Raise }); }))
+                    , sdbus::registerMethod("Quit") .implementedAs(I("Quit",  [&] { invoke({ .type = Command::Type::Quit  }); }))
+
+                    , sdbus::registerProperty("CanQuit")            .withGetter(I("Get.CanQuit",             [&] { return root_view().can_quit; }))
+                    , sdbus::registerProperty("Fullscreen")         .withGetter(I("Get.Fullscreen",          [&] { return fullscreen.load(); })).withSetter(I("Set.Fullscreen", M(set_fullscreen_external)))
+                    , sdbus::registerProperty("CanSetFullscreen")   .withGetter(I("Get.CanSetFullscreen",    [&] { return root_view().can_set_fullscreen; }))
+                    , sdbus::registerProperty("CanRaise")           .withGetter(I("Get.CanRaise",            [&] { return root_view().can_raise; }))
+                    , sdbus::registerProperty("HasTrackList")       .withGetter(I("Get.HasTrackList",        [&] { return root_view().has_track_list; }))
+                    , sdbus::registerProperty("Identity")           .withGetter(I("Get.Identity",            [&] () -> const std::string & { return *root_view().identity; }))
+                    , sdbus::registerProperty("DesktopEntry")       .withGetter(I("Get.DesktopEntry",        [&] () -> const std::string & { return *root_view().desktop_entry; }))
+                    , sdbus::registerProperty("SupportedUriSchemes").withGetter(I("Get.SupportedUriSchemes", [&] () -> const StringList &  { return *root_view().supported_uri_schemes; }))
+                    , sdbus::registerProperty("SupportedMimeTypes") .withGetter(I("Get.SupportedMimeTypes",  [&] () -> const StringList &  { return *root_view().supported_mime_types; }))
+                    ).forInterface(MP2);
+
+    object->addVTable(sdbus::registerMethod("Next")       .implementedAs(I("Next",        [&] { if (can_go_next())             invoke({ .type = Command::Type::Next      }); }))
+                    , sdbus::registerMethod("Previous")   .implementedAs(I("Previous",    [&] { if (can_go_previous())         invoke({ .type = Command::Type::Previous  }); }))
+                    , sdbus::registerMethod("Pause")      .implementedAs(I("Pause",       [&] { if (can_pause())               invoke({ .type = Command::Type::Pause     }); }))
+                    , sdbus::registerMethod("PlayPause")  .implementedAs(I("PlayPause",   [&] { if (can_play() || can_pause()) invoke({ .type = Command::Type::PlayPause }); }))
+                    , sdbus::registerMethod("Stop")       .implementedAs(I("Stop",        [&] { if (can_control())             invoke({ .type = Command::Type::Stop      }); }))
+                    , sdbus::registerMethod("Play")       .implementedAs(I("Play",        [&] { if (can_play())                invoke({ .type = Command::Type::Play      }); }))
+                    , sdbus::registerMethod("Seek")       .implementedAs(I("Seek",        [&] (sdbus::Result<> &&r, int64_t n) { seek_method(std::move(r), n); }))
+                                                                                                                                           .withInputParamNames("Offset")
+                    , sdbus::registerMethod("SetPosition").implementedAs(I("SetPosition", [&] (sdbus::Result<> &&r, sdbus::ObjectPath id, int64_t p) { set_position_method(std::move(r), std::move(id), p); }))
+                                                                                                                                           .withInputParamNames("TrackId", "Position")
+                    , sdbus::registerMethod("OpenUri")    .implementedAs(I("OpenUri",     [&] (sdbus::Result<> &&r, const std::string &uri) { open_uri(std::move(r), uri); }))
+                                                                                                                                           .withInputParamNames("Uri")
+
+                    , sdbus::registerProperty("PlaybackStatus").withGetter(I("Get.PlaybackStatus", [&] { return detail::playback_status_to_string(playback_status); }))
+                    , sdbus::registerProperty("LoopStatus")    .withGetter(I("Get.LoopStatus",     [&] { return detail::loop_status_to_string(loop_status); })).withSetter(I("Set.LoopStatus", M(set_loop_status_external)))
+                    , sdbus::registerProperty("Rate")          .withGetter(I("Get.Rate",           [&] { return rate.load(); })).withSetter(I("Set.Rate", M(set_rate_external)))
+                    , sdbus::registerProperty("Shuffle")       .withGetter(I("Get.Shuffle",        [&] { return shuffle.load(); })).withSetter(I("Set.Shuffle", M(set_shuffle_external)))
+                    , sdbus::registerProperty("Metadata")      .withGetter(I("Get.Metadata",       [&] () -> const TrackMetadata & { return *player_view().metadata; }))
+                    , sdbus::registerProperty("Volume")        .withGetter(I("Get.Volume",         [&] { return volume.load(); })).withSetter(I("Set.Volume", M(set_volume_external)))
+                    , sdbus::registerProperty("Position")      .withGetter(I("Get.Position",       M(current_position)))
+                    , sdbus::registerProperty("MinimumRate")   .withGetter(I("Get.MinimumRate",    [&] { return minimum_rate.load(); }))
+                    , sdbus::registerProperty("MaximumRate")   .withGetter(I("Get.MaximumRate",    [&] { return maximum_rate.load(); }))
+                    , sdbus::registerProperty("CanGoNext")     .withGetter(I("Get.CanGoNext",      [&] { return player_view().can_go_next; }))
+                    , sdbus::registerProperty("CanGoPrevious") .withGetter(I("Get.CanGoPrevious",  [&] { return player_view().can_go_previous; }))
+                    , sdbus::registerProperty("CanPlay")       .withGetter(I("Get.CanPlay",        [&] { return player_view().can_play; }))
+                    , sdbus::registerProperty("CanPause")      .withGetter(I("Get.CanPause",       [&] { return player_view().can_pause; }))
+                    , sdbus::registerProperty("CanSeek")       .withGetter(I("Get.CanSeek",        [&] { return player_view().can_seek; }))
+                    , sdbus::registerProperty("CanControl")    .withGetter(I("Get.CanControl",     [&] { return player_view().can_control; }))
+
+                    , sdbus::registerSignal("Seeked").withParameters<int64_t>("Position")
+                    ).forInterface(MP2P);
+
+    object->addVTable(sdbus::registerMethod("GetTracksMetadata").implementedAs(I("GetTracksMetadata", M(get_tracks_metadata))).withInputParamNames("TrackIds").withOutputParamNames("Metadata")
+                    , sdbus::registerMethod("AddTrack")         .implementedAs(I("AddTrack",          M(add_track_method)))   .withInputParamNames("Uri", "AfterTrack", "SetAsCurrent")
+                    , sdbus::registerMethod("RemoveTrack")      .implementedAs(I("RemoveTrack",       M(remove_track_method))).withInputParamNames("TrackId")
+                    , sdbus::registerMethod("GoTo")             .implementedAs(I("GoTo",              M(go_to_method)))       .withInputParamNames("TrackId")
+
+                    , sdbus::registerProperty("Tracks")         .withGetter(I("Get.Tracks",        M(track_ids)))
+                    , sdbus::registerProperty("CanEditTracks")  .withGetter(I("Get.CanEditTracks", M(can_edit_tracks)))
+
+                    , sdbus::registerSignal("TrackListReplaced")   .withParameters<std::vector<sdbus::ObjectPath>, sdbus::ObjectPath>("Tracks", "CurrentTrack")
+                    , sdbus::registerSignal("TrackAdded")          .withParameters<Metadata, sdbus::ObjectPath>("Metadata", "AfterTrack")
+                    , sdbus::registerSignal("TrackRemoved")        .withParameters<sdbus::ObjectPath>("TrackId")
+                    , sdbus::registerSignal("TrackMetadataChanged").withParameters<sdbus::ObjectPath, Metadata>("TrackId", "Metadata")
+                    ).forInterface(MP2TL);
+
+    object->addVTable(sdbus::registerMethod("ActivatePlaylist").implementedAs(I("ActivatePlaylist", M(activate_playlist_method))).withInputParamNames("PlaylistId")
+                    , sdbus::registerMethod("GetPlaylists")    .implementedAs(I("GetPlaylists",     M(get_playlists)))           .withInputParamNames("Index", "MaxCount", "Order", "ReverseOrder")
+                                                                                                            .withOutputParamNames("Playlists")
+
+                    , sdbus::registerProperty("PlaylistCount") .withGetter(I("Get.PlaylistCount",  M(playlist_count)))
+                    , sdbus::registerProperty("Orderings")     .withGetter(I("Get.Orderings",      M(get_playlist_orderings)))
+                    , sdbus::registerProperty("ActivePlaylist").withGetter(I("Get.ActivePlaylist", M(get_active_playlist)))
+
+                    , sdbus::registerSignal("PlaylistChanged") .withParameters<detail::DBusPlaylist>("Playlist")
+                    ).forInterface(MP2PL);
+#undef M
+#undef I
+}
+
+inline Server::~Server()
+{
+    // on_ready may drop the server; the connect thread doesn't touch it
+    // after that call
+    if (connect_thread.joinable()) {
+        if (connect_thread.get_id() == std::this_thread::get_id())
+            connect_thread.detach();
+        else
+            connect_thread.join();
+    }
+    // signals are dropped from here on, so async jobs still queued and the
+    // throttle thread may finish their work: the object is only destroyed
+    // once nothing else can use it
+    {
+        std::lock_guard lock(start_mutex);
+        ready = false;
+    }
+    if (connection)
+        connection->leaveEventLoop();
+    stop_throttle_thread();
+    seek_worker.reset();
+    workers.reset();
+    object.reset();
+    if (command_event_fd != -1)
+        close(command_event_fd);
+    if (throttle_event_fd != -1)
+        close(throttle_event_fd);
+}
+
+inline void Server::start_loop()
+{
+    if (connect_thread.joinable() && connect_thread.get_id() != std::this_thread::get_id())
+        connect_thread.join();
+    if (ready)
+        connection->enterEventLoop();
+}
+
+inline void Server::start_loop_async()
+{
+    {
+        std::lock_guard lock(start_mutex);
+        if (!ready) {
+            loop_requested = true;
+            return;
+        }
+    }
+    connection->enterEventLoopAsync();
+}
+
+inline PollData Server::poll_data()
+{
+    bool switched;
+    {
+        std::lock_guard lock(pending_mutex);
+        switched = !external_loop;
+        if (switched)
+            throttle_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        external_loop = true;
+    }
+    if (switched)
+        stop_throttle_thread();
+    auto pd = connection->getEventLoopPollData();
+    PollData r = { .fd = pd.fd, .events = pd.events, .event_fd = pd.eventFd, .wake_fd = throttle_event_fd,
+                   .timeout_ms = pd.getPollTimeout() };
+    std::lock_guard lock(pending_mutex);
+    auto now  = std::chrono::steady_clock::now();
+    auto next = flush_throttles(now);
+    if (next != std::chrono::steady_clock::time_point::max()) {
+        auto ms = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(next - now).count());
+        r.timeout_ms = r.timeout_ms < 0 ? ms : std::min(r.timeout_ms, ms);
+    }
+    return r;
+}
+
+inline void Server::process_pending()
+{
+    while (connection->processPendingEvent())
+        ;
+    std::lock_guard lock(pending_mutex);
+    if (!external_loop)
+        return;
+    // the next poll_data() accounts for every pending throttle
+    uint64_t n;
+    [[maybe_unused]] auto r = read(throttle_event_fd, &n, sizeof(n));
+    flush_throttles(std::chrono::steady_clock::now());
+}
+
+namespace detail {
+
+inline uint64_t fnv1a(std::string_view data)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (unsigned char c : data)
+        h = (h ^ c) * 0x100000001b3;
+    return h;
+}
+
+inline const char *image_extension(std::string_view data)
+{
+    if (data.starts_with("\x89PNG"))                               return ".png";
+    if (data.starts_with("\xFF\xD8\xFF"))                          return ".jpg";
+    if (data.starts_with("GIF8"))                                  return ".gif";
+    if (data.starts_with("RIFF") && data.substr(8, 4) == "WEBP")   return ".webp";
+    return "";
+}
+
+} // namespace detail
+
+inline ArtCache::ArtCache(std::size_t max_bytes)
+    : max_bytes(max_bytes)
+{
+    const char *base = std::getenv("XDG_RUNTIME_DIR");
+    auto tmpl = std::string(base && *base ? base : "/tmp") + "/mpris-art-XXXXXX";
+    // a fresh directory only we can write to; empty if it can't be created,
+    // in which case nothing is ever stored
+    if (mkdtemp(tmpl.data()))
+        dir = std::move(tmpl);
+}
+
+inline ArtCache::~ArtCache()
+{
+    for (const auto &[_, e] : entries)
+        unlink(e.path.c_str());
+    if (!dir.empty())
+        rmdir(dir.c_str());
+}
+
+inline std::string ArtCache::add(std::string_view image)
+{
+    std::lock_guard lock(mutex);
+    auto key = store(image);
+    return key.empty() ? "" : url(key);
+}
+
+inline std::string ArtCache::add_file(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return "";
+    auto id = std::make_tuple(path, int64_t(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec, int64_t(st.st_size));
+    std::lock_guard lock(mutex);
+    if (auto f = files.find(id); f != files.end()) {
+        entries[f->second].last_used = ++clock;
+        return url(f->second);
+    }
+    auto file = fopen(path.c_str(), "rb");
+    if (!file)
+        return "";
+    std::string data(st.st_size, '\0');
+    auto n = fread(data.data(), 1, data.size(), file);
+    fclose(file);
+    if (n != data.size())
+        return "";
+    auto key = store(data);
+    if (key.empty())
+        return "";
+    files.insert_or_assign(std::move(id), key);
+    return url(key);
+}
+
+inline std::size_t ArtCache::size()
+{
+    std::lock_guard lock(mutex);
+    return total;
+}
+
+// Returns the content key of the image, writing it if needed. Must be
+// called with mutex held.
+inline std::string ArtCache::store(std::string_view image)
+{
+    if (dir.empty())
+        return "";
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-%zx%s", static_cast<unsigned long long>(detail::fnv1a(image)), image.size(),
+             detail::image_extension(image));
+    std::string key = name;
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        auto path = dir + "/" + key;
+        auto tmp  = path + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return "";
+        std::size_t written = 0;
+        while (written < image.size()) {
+            auto r = write(fd, image.data() + written, image.size() - written);
+            if (r <= 0)
+                break;
+            written += r;
+        }
+        close(fd);
+        if (written != image.size() || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return "";
+        }
+        it = entries.emplace(key, Entry{ std::move(path), image.size(), 0 }).first;
+        total += image.size();
+    }
+    it->second.last_used = ++clock;
+    evict();
+    return key;
+}
+
+// Never removes the most recently used image. Must be called with mutex held.
+inline void ArtCache::evict()
+{
+    while (total > max_bytes && entries.size() > 1) {
+        auto victim = std::min_element(entries.begin(), entries.end(), [] (const auto &a, const auto &b) {
+            return a.second.last_used < b.second.last_used;
+        });
+        unlink(victim->second.path.c_str());
+        total -= victim->second.size;
+        std::erase_if(files, [&] (const auto &f) { return f.second == victim->first; });
+        entries.erase(victim);
+    }
+}
+
+inline EpollAdapter::EpollAdapter(Server &server, int epfd)
+    : server(server), epfd(epfd)
+{
+    auto pd = server.poll_data();
+    fd       = pd.fd;
+    event_fd = pd.event_fd;
+    wake_fd  = pd.wake_fd;
+    events   = static_cast<uint32_t>(pd.events);
+    epoll_event ev = { .events = events, .data = { .ptr = this } };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    ev.events = EPOLLIN;
+    if (event_fd != -1 && event_fd != fd)
+        epoll_ctl(epfd, EPOLL_CTL_ADD, event_fd, &ev);
+    if (wake_fd != -1)
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+}
+
+inline EpollAdapter::~EpollAdapter()
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    if (event_fd != -1 && event_fd != fd)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, event_fd, nullptr);
+    if (wake_fd != -1)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, wake_fd, nullptr);
+}
+
+inline int EpollAdapter::timeout()
+{
+    auto pd = server.poll_data();
+    if (static_cast<uint32_t>(pd.events) != events) {
+        events = static_cast<uint32_t>(pd.events);
+        epoll_event ev = { .events = events, .data = { .ptr = this } };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    return pd.timeout_ms;
+}
+
+inline bool EpollAdapter::owns(const epoll_event &event) const { return event.data.ptr == this; }
+
+inline ServerPool::ServerPool()
+    : epfd(epoll_create1(EPOLL_CLOEXEC)), wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    epoll_event ev = { .events = EPOLLIN, .data = { .ptr = nullptr } };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+}
+
+inline ServerPool::~ServerPool()
+{
+    stop();
+    entries.clear();
+    close(wake_fd);
+    close(epfd);
+}
+
+inline Server *ServerPool::add(std::string_view name, const std::function<void(Server &)> &setup)
+{
+    try {
+        return add(name, sdbus::createSessionBusConnection(), setup);
+    } catch (const sdbus::Error &error) {
+        return nullptr;
+    }
+}
+
+inline Server *ServerPool::add(std::string_view name, std::unique_ptr<sdbus::IConnection> connection,
+                               const std::function<void(Server &)> &setup)
+{
+    auto server = Server::make(name, std::move(connection));
+    if (!server)
+        return nullptr;
+    if (setup)
+        setup(*server);
+    std::lock_guard lock(mutex);
+    auto adapter = std::make_unique<EpollAdapter>(*server, epfd);
+    auto &e = entries[adapter.get()];
+    e.server  = std::move(server);
+    e.adapter = std::move(adapter);
+    dispatch(e);
+    wake();
+    return e.server.get();
+}
+
+inline void ServerPool::remove(Server *server)
+{
+    std::lock_guard lock(mutex);
+    auto it = std::find_if(entries.begin(), entries.end(), [&] (const auto &e) { return e.second.server.get() == server; });
+    if (it != entries.end())
+        entries.erase(it);
+    wake();
+}
+
+inline std::size_t ServerPool::size()
+{
+    std::lock_guard lock(mutex);
+    return entries.size();
+}
+
+inline void ServerPool::start()
+{
+    if (running.exchange(true))
+        return;
+    thread = std::thread([this] { run(); });
+}
+
+inline void ServerPool::stop()
+{
+    if (!running.exchange(false))
+        return;
+    wake();
+    thread.join();
+}
+
+inline void ServerPool::wake()
+{
+    uint64_t n = 1;
+    [[maybe_unused]] auto r = write(wake_fd, &n, sizeof(n));
+}
+
+// must be called with mutex held
+inline void ServerPool::dispatch(Entry &entry)
+{
+    entry.adapter->dispatch();
+    auto t = entry.adapter->timeout();
+    entry.deadline = t < 0 ? std::chrono::steady_clock::time_point::max()
+                           : std::chrono::steady_clock::now() + std::chrono::milliseconds(t);
+}
+
+inline void ServerPool::run()
+{
+    std::array<epoll_event, 64> events;
+    while (running) {
+        int timeout = -1;
+        {
+            std::lock_guard lock(mutex);
+            auto next = std::chrono::steady_clock::time_point::max();
+            for (const auto &[_, e] : entries)
+                next = std::min(next, e.deadline);
+            if (next != std::chrono::steady_clock::time_point::max()) {
+                auto ms = std::chrono::ceil<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count();
+                timeout = static_cast<int>(std::max<int64_t>(ms, 0));
+            }
+        }
+        int n = epoll_wait(epfd, events.data(), events.size(), timeout);
+        std::lock_guard lock(mutex);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == nullptr) {
+                uint64_t v;
+                [[maybe_unused]] auto r = read(wake_fd, &v, sizeof(v));
+                continue;
+            }
+            // entries removed since epoll_wait returned are simply not found
+            auto it = entries.find(static_cast<const EpollAdapter *>(events[i].data.ptr));
+            if (it != entries.end())
+                dispatch(it->second);
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (auto &[_, e] : entries)
+            if (e.deadline <= now)
+                dispatch(e);
+    }
+}
+
+inline void Server::send_seeked_signal(int64_t position)
+{
+    if (!ready)
+        return;
+    metrics_recorder.signal();
+    auto signal = object->createSignal(MP2P.c_str(), "Seeked");
+    signal << position;
+    object->emitSignal(signal);
+}
+
+inline Client::Client()
+    : Client(sdbus::createSessionBusConnection())
+{
+}
+
+inline Client::Client(std::unique_ptr<sdbus::IConnection> conn)
+    : connection(std::move(conn))
+{
+    bus = sdbus::createProxy(*connection, sdbus::ServiceName{"org.freedesktop.DBus"}, sdbus::ObjectPath{"/org/freedesktop/DBus"});
+    // filtered by the bus, so that other names coming and going don't wake us
+    name_owner_match = connection->addMatch("type='signal',sender='org.freedesktop.DBus',path='/org/freedesktop/DBus',"
+                                            "interface='org.freedesktop.DBus',member='NameOwnerChanged',"
+                                            "arg0namespace='" + MP2 + "'",
+        [this] (sdbus::Message msg) {
+            std::string service, old_owner, new_owner;
+            msg >> service >> old_owner >> new_owner;
+            name_owner_changed(service, old_owner, new_owner);
+        });
+}
+
+inline Client::~Client()
+{
+    connection->leaveEventLoop();
+}
+
+inline std::vector<std::string> Client::players() const
+{
+    std::lock_guard lock(mutex);
+    std::vector<std::string> r;
+    for (const auto &[name, p] : players_)
+        if (p.pending == 0)
+            r.push_back(name);
+    return r;
+}
+
+inline std::shared_ptr<const PlayerState> Client::player(std::string_view name) const
+{
+    std::lock_guard lock(mutex);
+    auto it = players_.find(name);
+    return it == players_.end() || it->second.pending != 0 ? nullptr : it->second.state;
+}
+
+inline void Client::start_loop()       { discover(); connection->enterEventLoop(); }
+inline void Client::start_loop_async() { discover(); connection->enterEventLoopAsync(); }
+inline void Client::stop()             { connection->leaveEventLoop(); }
+
+inline void Client::discover()
+{
+    StringList names;
+    bus->callMethod("ListNames").onInterface("org.freedesktop.DBus").storeResultsTo(names);
+    for (const auto &service : names)
+        if (service.starts_with(PREFIX))
+            add_player(service.substr(PREFIX.size()));
+}
+
+inline void Client::name_owner_changed(const std::string &service, const std::string &old_owner, const std::string &new_owner)
+{
+    if (!service.starts_with(PREFIX))
+        return;
+    auto name = service.substr(PREFIX.size());
+    if (!old_owner.empty())
+        remove_player(name);
+    if (!new_owner.empty())
+        add_player(name);
+}
+
+inline void Client::add_player(const std::string &name)
+{
+    auto proxy = sdbus::createProxy(*connection, sdbus::ServiceName{PREFIX + name}, sdbus::ObjectPath{OBJECT_PATH});
+    proxy->uponSignal("PropertiesChanged").onInterface(PROPS)
+        .call([this, name] (const std::string &interface, const std::map<std::string, sdbus::Variant> &changed, const StringList &invalidated) {
+            if (interface == MP2 || interface == MP2P)
+                properties_changed(name, changed, invalidated);
+        });
+    proxy->uponSignal("Seeked").onInterface(MP2P).call([this, name] (int64_t position) {
+        auto state = update(name, [&] (PlayerState &s) {
+            s.anchor.position = position;
+            s.anchor.time     = std::chrono::steady_clock::now();
+        });
+        if (state && seeked_fn)
+            seeked_fn(*state);
+    });
+    {
+        std::lock_guard lock(mutex);
+        auto state = std::make_shared<PlayerState>();
+        state->name = name;
+        players_.insert_or_assign(name, Player{ std::move(proxy), std::move(state) });
+    }
+    fetch(name, MP2);
+    fetch(name, MP2P);
+}
+
+inline void Client::remove_player(const std::string &name)
+{
+    Player p;
+    {
+        std::lock_guard lock(mutex);
+        auto it = players_.find(name);
+        if (it == players_.end())
+            return;
+        p = std::move(it->second);
+        players_.erase(it);
+    }
+    if (p.pending == 0 && player_removed_fn)
+        player_removed_fn(name);
+}
+
+// Reads every property of an interface; the player is announced once both
+// interfaces have been read.
+inline void Client::fetch(const std::string &name, const std::string &interface)
+{
+    std::lock_guard lock(mutex);
+    auto it = players_.find(name);
+    if (it == players_.end())
+        return;
+    it->second.proxy->callMethodAsync("GetAll").onInterface(PROPS).withArguments(interface)
+        .uponReplyInvoke([this, name] (std::optional<sdbus::Error> error, const std::map<std::string, sdbus::Variant> &values) {
+            bool ready = false;
+            auto state = update(name, [&] (PlayerState &s) {
+                if (!error)
+                    for (const auto &[k, v] : values)
+                        apply(s, k, v);
+            });
+            {
+                std::lock_guard lock(mutex);
+                if (auto it = players_.find(name); it != players_.end())
+                    ready = --it->second.pending == 0;
+            }
+            if (ready && player_added_fn)
+                player_added_fn(*state);
+        });
+}
+
+inline void Client::properties_changed(const std::string &name, const std::map<std::string, sdbus::Variant> &changed,
+                                       const StringList &invalidated)
+{
+    auto state = update(name, [&] (PlayerState &s) {
+        for (const auto &[k, v] : changed)
+            apply(s, k, v);
+    });
+    if (!state)
+        return;
+    // players may announce a change without its value; read it then
+    for (const auto &property : invalidated) {
+        auto prop = detail::find_prop(property);
+        if (!prop)
+            continue;
+        std::lock_guard lock(mutex);
+        auto it = players_.find(name);
+        if (it == players_.end())
+            break;
+        const auto &interface = detail::prop_table[static_cast<int>(*prop)].interface == 0 ? MP2 : MP2P;
+        it->second.proxy->callMethodAsync("Get").onInterface(PROPS).withArguments(interface, property)
+            .uponReplyInvoke([this, name, property] (std::optional<sdbus::Error> error, const sdbus::Variant &value) {
+                if (error)
+                    return;
+                auto state = update(name, [&] (PlayerState &s) { apply(s, property, value); });
+                if (state && properties_changed_fn)
+                    properties_changed_fn(*state, StringList{property});
+            });
+    }
+    if (!changed.empty() && properties_changed_fn) {
+        StringList names;
+        for (const auto &[k, _] : changed)
+            names.push_back(k);
+        properties_changed_fn(*state, names);
+    }
+}
+
+// Replaces the state of a player with a modified copy, so that readers
+// holding the old one aren't disturbed.
+inline std::shared_ptr<const PlayerState> Client::update(std::string_view name, const std::function<void(PlayerState &)> &fn)
+{
+    std::lock_guard lock(mutex);
+    auto it = players_.find(name);
+    if (it == players_.end())
+        return nullptr;
+    auto state = std::make_shared<PlayerState>(*it->second.state);
+    fn(*state);
+    it->second.state = state;
+    return state;
+}
+
+inline void Client::apply(PlayerState &s, const std::string &property, const sdbus::Variant &v)
+{
+    using detail::Prop;
+    auto now = std::chrono::steady_clock::now();
+    auto reanchor = [&] {
+        s.anchor.position = s.anchor.at(now);
+        s.anchor.time     = now;
+    };
+    // a third-party player may send a property with the wrong type: skip it
+    try {
+        if (property == "Position") {
+            s.anchor.position = v.get<int64_t>();
+            s.anchor.time     = now;
+            return;
+        }
+        auto prop = detail::find_prop(property);
+        if (!prop)
+            return;
+        switch (*prop) {
+        case Prop::CanQuit:             s.can_quit              = v.get<bool>();        break;
+        case Prop::CanRaise:            s.can_raise             = v.get<bool>();        break;
+        case Prop::CanSetFullscreen:    s.can_set_fullscreen    = v.get<bool>();        break;
+        case Prop::Fullscreen:          s.fullscreen            = v.get<bool>();        break;
+        case Prop::HasTrackList:        s.has_track_list        = v.get<bool>();        break;
+        case Prop::Identity:            s.identity              = v.get<std::string>(); break;
+        case Prop::DesktopEntry:        s.desktop_entry         = v.get<std::string>(); break;
+        case Prop::SupportedUriSchemes: s.supported_uri_schemes = v.get<StringList>();  break;
+        case Prop::SupportedMimeTypes:  s.supported_mime_types  = v.get<StringList>();  break;
+        case Prop::LoopStatus:          s.loop_status           = detail::enum_from_string(loop_status_strings, v.get<std::string>(), LoopStatus::None); break;
+        case Prop::Shuffle:             s.shuffle               = v.get<bool>();        break;
+        case Prop::Volume:              s.volume                = v.get<double>();      break;
+        case Prop::MinimumRate:         s.minimum_rate          = v.get<double>();      break;
+        case Prop::MaximumRate:         s.maximum_rate          = v.get<double>();      break;
+        case Prop::CanGoNext:           s.can_go_next           = v.get<bool>();        break;
+        case Prop::CanGoPrevious:       s.can_go_previous       = v.get<bool>();        break;
+        case Prop::CanPlay:             s.can_play              = v.get<bool>();        break;
+        case Prop::CanPause:            s.can_pause             = v.get<bool>();        break;
+        case Prop::CanSeek:             s.can_seek              = v.get<bool>();        break;
+        case Prop::PlaybackStatus:
+            reanchor();
+            s.playback_status = detail::enum_from_string(playback_status_strings, v.get<std::string>(), PlaybackStatus::Stopped);
+            s.anchor.playing  = s.playback_status == PlaybackStatus::Playing;
+            break;
+        case Prop::Rate:
+            reanchor();
+            s.rate = s.anchor.rate = v.get<double>();
+            break;
+        case Prop::Metadata: {
+            auto m = TrackMetadata::from_dbus(v.get<Metadata>());
+            auto id = m.get<Field::TrackId>();
+            auto old_id = s.metadata.get<Field::TrackId>();
+            if (bool(id) != bool(old_id) || (id && *id != *old_id)) {
+                // a new track starts from the beginning unless Seeked says otherwise
+                s.anchor.position = 0;
+                s.anchor.time     = now;
+            }
+            s.anchor.length = detail::track_length(m.value(Field::Length));
+            s.metadata = std::move(m);
+            break;
+        }
+        default:
+            break;
+        }
+    } catch (const sdbus::Error &) { }
+}
+
+#else
+
+inline void Server::control_props_changed(auto... props) { }
+inline void Server::emit_props(detail::PropMask props) { }
+inline void Server::refresh_props(detail::PropMask props) { }
+inline detail::RootProps Server::make_root_props() const { return {}; }
+inline detail::PlayerProps Server::make_player_props() const { return {}; }
+inline const detail::RootProps &Server::root_view() const { static detail::RootProps v; return v; }
+inline const detail::PlayerProps &Server::player_view() const { static detail::PlayerProps v; return v; }
+inline void Server::send_props(detail::PropMask props) { }
+inline void Server::write_prop(detail::Prop prop, sdbus::Message &msg) { }
+inline bool Server::throttle(detail::Prop prop, std::chrono::steady_clock::time_point now) { return false; }
+inline void Server::throttle_loop() { }
+inline std::chrono::steady_clock::time_point Server::flush_throttles(std::chrono::steady_clock::time_point now) { return now; }
+inline void Server::stop_throttle_thread() { }
+inline void Server::set_throttle(std::string_view property, std::chrono::milliseconds interval) { }
+inline void Server::begin_update() { batch_depth++; }
+inline void Server::commit() { if (batch_depth > 0) batch_depth--; }
+inline void Server::set_fullscreen_external(bool value) { }
+inline void Server::set_loop_status_external(const std::string &value) { }
+inline void Server::set_rate_external(double value) { }
+inline void Server::set_shuffle_external(bool value) { }
 inline void Server::set_volume_external(double value) { }
-inline void Server::set_position_method(sdbus::ObjectPath id, int64_t pos) { }
-inline void Server::open_uri(const std::string &uri) { }
+inline bool Server::is_current_track(const sdbus::ObjectPath &id) const { return false; }
+inline void Server::seek_method(sdbus::Result<> &&result, int64_t offset) { }
+inline void Server::set_position_method(sdbus::Result<> &&result, sdbus::ObjectPath id, int64_t pos) { }
+inline void Server::open_uri(sdbus::Result<> &&result, const std::string &uri) { }
+inline void Server::reply(sdbus::Result<> &&result, const std::function<void()> &fn) { }
+inline void Server::run_async(detail::WorkerPool *pool, sdbus::Result<> &&result, std::function<void()> job) { }
 inline std::unique_ptr<Server> Server::make(std::string_view name) { return std::make_unique<Server>(name); }
+inline std::unique_ptr<Server> Server::make(std::string_view name, std::unique_ptr<sdbus::IConnection> connection) { return std::make_unique<Server>(name); }
 inline Server::Server(std::string_view name) { }
+inline Server::Server(std::string_view name, std::unique_ptr<sdbus::IConnection> connection) { }
+inline std::unique_ptr<Server> Server::make_async(std::string_view name, std::function<void(const StartResult &)> on_ready)
+{
+    auto s = std::make_unique<Server>(name);
+    if (on_ready)
+        on_ready({ .ok = true, .bus_name = PREFIX + std::string(name), .error = {} });
+    return s;
+}
+inline void Server::connect_async(std::function<void(const StartResult &)> on_ready) { }
+inline void Server::register_object() { }
+inline Server::~Server() { }
+inline void Server::invoke(const Command &cmd, const std::function<void()> &accepted) { }
+inline void Server::run_command(const Command &cmd) { }
+inline void Server::set_dispatch_mode(DispatchMode mode) { dispatch_mode.store(mode); }
+inline bool Server::poll_command(Command &cmd) { return false; }
+inline void Server::drain_commands() { }
+inline detail::TrackList &Server::tracks() { if (!tracklist) tracklist = std::make_unique<detail::TrackList>(); return *tracklist; }
+inline TrackMetadata Server::track_metadata(const detail::TrackList::Track &track) { return {}; }
+inline std::vector<TrackMetadata> Server::get_tracks_metadata(const std::vector<sdbus::ObjectPath> &ids) { return {}; }
+inline void Server::add_track_method(const std::string &uri, sdbus::ObjectPath after, bool set_as_current) { }
+inline void Server::remove_track_method(sdbus::ObjectPath id) { }
+inline void Server::go_to_method(sdbus::ObjectPath id) { }
+inline std::vector<sdbus::ObjectPath> Server::track_ids() { return {}; }
+inline void Server::add_track(std::string_view id, const std::map<Field, sdbus::Variant> &metadata, std::string_view after) { }
+inline void Server::remove_track(std::string_view id) { }
+inline void Server::set_track_metadata(std::string_view id, const std::map<Field, sdbus::Variant> &metadata) { }
+inline void Server::replace_tracks(const std::vector<std::pair<std::string, std::map<Field, sdbus::Variant>>> &tracks,
+                                   std::string_view current) { }
+inline const std::vector<uint32_t> &Server::playlist_order(PlaylistOrdering order) { return playlist_orders[order]; }
+inline std::vector<detail::DBusPlaylist> Server::get_playlists(uint32_t index, uint32_t max_count, const std::string &order, bool reverse) { return {}; }
+inline void Server::activate_playlist_method(sdbus::ObjectPath id) { }
+inline StringList Server::get_playlist_orderings() { return {}; }
+inline sdbus::Struct<bool, detail::DBusPlaylist> Server::get_active_playlist() { return {}; }
+inline void Server::set_playlist_orderings(const std::vector<PlaylistOrdering> &orderings) { }
+inline void Server::set_active_playlist(const std::optional<Playlist> &playlist) { }
+inline void Server::playlists_changed() { }
+inline void Server::playlist_changed(const Playlist &playlist) { }
+inline void Server::export_metrics() { }
 inline void Server::start_loop() { }
 inline void Server::start_loop_async() { }
+inline PollData Server::poll_data() { return {}; }
+inline void Server::process_pending() { }
+inline ArtCache::ArtCache(std::size_t max_bytes) : max_bytes(max_bytes) { }
+inline ArtCache::~ArtCache() { }
+inline std::string ArtCache::add(std::string_view image) { return ""; }
+inline std::string ArtCache::add_file(const std::string &path) { return ""; }
+inline std::size_t ArtCache::size() { return 0; }
+inline std::string ArtCache::store(std::string_view image) { return ""; }
+inline void ArtCache::evict() { }
+inline EpollAdapter::EpollAdapter(Server &server, int epfd) : server(server), epfd(epfd) { }
+inline EpollAdapter::~EpollAdapter() { }
+inline int EpollAdapter::timeout() { return -1; }
+inline bool EpollAdapter::owns(const epoll_event &event) const { return false; }
+inline ServerPool::ServerPool() { }
+inline ServerPool::~ServerPool() { }
+inline Server *ServerPool::add(std::string_view name, const std::function<void(Server &)> &setup) { return nullptr; }
+inline Server *ServerPool::add(std::string_view name, std::unique_ptr<sdbus::IConnection> connection,
+                               const std::function<void(Server &)> &setup) { return nullptr; }
+inline void ServerPool::remove(Server *server) { }
+inline std::size_t ServerPool::size() { return 0; }
+inline void ServerPool::start() { }
+inline void ServerPool::stop() { }
+inline void ServerPool::run() { }
+inline void ServerPool::wake() { }
+inline void ServerPool::dispatch(Entry &entry) { }
 inline void Server::send_seeked_signal(int64_t position) { }
+inline Client::Client() { }
+inline Client::Client(std::unique_ptr<sdbus::IConnection> connection) { }
+inline Client::~Client() { }
+inline std::vector<std::string> Client::players() const { return {}; }
+inline std::shared_ptr<const PlayerState> Client::player(std::string_view name) const { return nullptr; }
+inline void Client::start_loop() { }
+inline void Client::start_loop_async() { }
+inline void Client::stop() { }
+inline void Client::discover() { }
+inline void Client::name_owner_changed(const std::string &service, const std::string &old_owner, const std::string &new_owner) { }
+inline void Client::add_player(const std::string &name) { }
+inline void Client::remove_player(const std::string &name) { }
+inline void Client::fetch(const std::string &name, const std::string &interface) { }
+inline void Client::properties_changed(const std::string &name, const std::map<std::string, sdbus::Variant> &changed,
+                                       const StringList &invalidated) { }
+inline std::shared_ptr<const PlayerState> Client::update(std::string_view name, const std::function<void(PlayerState &)> &fn) { return nullptr; }
+inline void Client::apply(PlayerState &state, const std::string &property, const sdbus::Variant &value) { }
 
 #endif
 
@@ -0,0 +1,38 @@
+#include "../src/mpris_server.hpp"
+#include "../bench/private_bus.hpp"
+#include "../bench/count_new.hpp"
+
+// Steady-state setters write PropertiesChanged straight into the sd-bus
+// message and must not allocate. Only operator new is counted: buffers
+// allocated by sd-bus itself are not.
+
+int main()
+{
+    Bus bus;
+    auto server = mpris::Server::make("alloc");
+    if (!server) {
+        fprintf(stderr, "can't create server\n");
+        return 1;
+    }
+    server->set_metadata(mpris::TrackMetadata()
+        .set<mpris::Field::TrackId>(sdbus::ObjectPath("/track/1"))
+        .set<mpris::Field::Title  >("a title"));
+    server->start_loop_async();
+
+    bool ok = true;
+    auto check = [&] (const char *name, auto &&f) {
+        for (std::size_t i = 0; i < 100; i++)
+            f(i);
+        auto a = allocations.load();
+        for (std::size_t i = 0; i < 10'000; i++)
+            f(i);
+        auto n = allocations.load() - a;
+        printf("{\"test\":\"%s\",\"allocs\":%llu}\n", name, static_cast<unsigned long long>(n));
+        ok &= n == 0;
+    };
+    check("zero_alloc.set_volume", [&] (std::size_t i) { server->set_volume(i & 1 ? 0.5 : 1.0); });
+    check("zero_alloc.set_playback_status", [&] (std::size_t i) {
+        server->set_playback_status(i & 1 ? mpris::PlaybackStatus::Playing : mpris::PlaybackStatus::Paused);
+    });
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,57 @@
+#include "../src/mpris_server.hpp"
+#include "../bench/private_bus.hpp"
+#include <chrono>
+#include <thread>
+
+// Checks that Position, extrapolated while playing, stops at the track's
+// Length however the metadata was given: typed, through the map API, or
+// field by field with a Variant of another integer type.
+
+int main()
+{
+    Bus bus;
+    auto server = mpris::Server::make("position");
+    if (!server) {
+        fprintf(stderr, "can't create server\n");
+        return 1;
+    }
+    const int64_t length = 1'000'000;
+
+    bool ok = true;
+    auto check = [&] (const char *name, auto &&set_length) {
+        server->set_playback_status(mpris::PlaybackStatus::Paused);
+        set_length();
+        server->set_position(length - 1'000);
+        server->set_playback_status(mpris::PlaybackStatus::Playing);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        auto pos = server->current_position();
+        printf("{\"test\":\"%s\",\"position\":%lld,\"length\":%lld}\n", name,
+               static_cast<long long>(pos), static_cast<long long>(length));
+        ok &= pos == length;
+    };
+    check("clamp.typed", [&] {
+        server->set_metadata(mpris::TrackMetadata()
+            .set<mpris::Field::TrackId>(sdbus::ObjectPath("/track/1"))
+            .set<mpris::Field::Length >(length));
+    });
+    check("clamp.map", [&] {
+        server->set_metadata(std::map<mpris::Field, sdbus::Variant>{
+            { mpris::Field::TrackId, sdbus::Variant(sdbus::ObjectPath("/track/2")) },
+            { mpris::Field::Length,  sdbus::Variant(length) },
+        });
+    });
+    check("clamp.update_map", [&] {
+        server->set_metadata(mpris::TrackMetadata().set<mpris::Field::TrackId>(sdbus::ObjectPath("/track/3")));
+        server->update_metadata(std::map<mpris::Field, sdbus::Variant>{ { mpris::Field::Length, sdbus::Variant(length) } });
+    });
+    check("clamp.field_uint64", [&] {
+        server->set_metadata(mpris::TrackMetadata().set<mpris::Field::TrackId>(sdbus::ObjectPath("/track/4")));
+        server->set_metadata_field(mpris::Field::Length, sdbus::Variant(static_cast<uint64_t>(length)));
+    });
+
+    auto m = mpris::TrackMetadata({ { mpris::Field::Length, sdbus::Variant(length) } });
+    bool typed = m.get<mpris::Field::Length>() && *m.get<mpris::Field::Length>() == length;
+    printf("{\"test\":\"map_api.typed_slot\",\"ok\":%s}\n", typed ? "true" : "false");
+    ok &= typed;
+    return ok ? 0 : 1;
+}
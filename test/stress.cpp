@@ -0,0 +1,103 @@
+#include "../src/mpris_server.hpp"
+#include "../bench/private_bus.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// Runs setters on several threads while clients on their own connections
+// call Get and GetAll, all against one Server on a private session bus. It
+// is built with -fsanitize=thread by `make test`, so any data race between
+// the setters and the getters running on the event loop thread makes it
+// fail. It also checks that every value read back is one that was set.
+
+using Clock = std::chrono::steady_clock;
+
+static const char *identities[] = { "player a", "player b", "player c" };
+
+static mpris::TrackMetadata track(int i)
+{
+    return mpris::TrackMetadata()
+        .set<mpris::Field::TrackId>(sdbus::ObjectPath("/track/" + std::to_string(i)))
+        .set<mpris::Field::Title  >("title " + std::to_string(i))
+        .set<mpris::Field::Artist >({ "an artist", "another artist" })
+        .set<mpris::Field::AsText >(std::string(1024 + i % 512, 'x'));
+}
+
+int main()
+{
+    Bus bus;
+    auto server = mpris::Server::make("stress");
+    if (!server) {
+        fprintf(stderr, "can't create server\n");
+        return 1;
+    }
+    const auto service = mpris::PREFIX + "stress";
+    server->set_maximum_rate(2.0);
+    server->set_minimum_rate(0.5);
+    server->on_play_pause([] { });
+    server->on_stop([] { });
+    server->on_loop_status_changed([] (mpris::LoopStatus) { });
+    server->on_shuffle_changed([] (bool) { });
+    server->on_volume_changed([] (double) { });
+    server->start_loop_async();
+
+    const auto duration = std::chrono::seconds(3);
+    auto deadline = Clock::now() + duration;
+    std::atomic<bool> failed = false;
+    std::atomic<uint64_t> sets = 0, gets = 0;
+    auto fail = [&] (const char *what) {
+        fprintf(stderr, "unexpected value: %s\n", what);
+        failed = true;
+    };
+
+    std::vector<std::thread> threads;
+    for (int w = 0; w < 2; w++) {
+        threads.emplace_back([&, w] {
+            for (int i = 0; Clock::now() < deadline; i++) {
+                server->set_identity(identities[i % 3]);
+                server->set_metadata(track(i));
+                server->set_metadata_field<mpris::Field::UseCount>(i);
+                server->set_volume((i % 10) / 10.0);
+                server->set_rate(i & 1 ? 0.5 : 1.5);
+                server->set_playback_status(i & 1 ? mpris::PlaybackStatus::Playing : mpris::PlaybackStatus::Paused);
+                server->set_position(int64_t(i) * 1000);
+                server->set_supported_mime_types({ "audio/x-" + std::to_string(w), "audio/mpeg" });
+                {
+                    auto u = server->update();
+                    server->set_shuffle(i & 1);
+                    server->set_loop_status(i & 1 ? mpris::LoopStatus::Track : mpris::LoopStatus::None);
+                }
+                sets++;
+            }
+        });
+    }
+    for (int c = 0; c < 4; c++) {
+        threads.emplace_back([&] {
+            auto conn  = sdbus::createSessionBusConnection();
+            auto proxy = sdbus::createProxy(*conn, sdbus::ServiceName{service}, sdbus::ObjectPath{mpris::OBJECT_PATH});
+            while (Clock::now() < deadline) {
+                auto identity = proxy->getProperty("Identity").onInterface(mpris::MP2).get<std::string>();
+                if (std::find(std::begin(identities), std::end(identities), identity) == std::end(identities) && !identity.empty())
+                    fail("Identity");
+                auto m = proxy->getProperty("Metadata").onInterface(mpris::MP2P).get<mpris::Metadata>();
+                auto title = m.find("xesam:title");
+                if (!m.empty() && (title == m.end() || !title->second.get<std::string>().starts_with("title ")))
+                    fail("Metadata");
+                auto volume = proxy->getProperty("Volume").onInterface(mpris::MP2P).get<double>();
+                if (volume < 0.0 || volume > 1.0)
+                    fail("Volume");
+                proxy->getProperty("Position").onInterface(mpris::MP2P);
+                proxy->getAllProperties().onInterface(mpris::MP2P);
+                proxy->getAllProperties().onInterface(mpris::MP2);
+                gets += 6;
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    printf("{\"test\":\"stress\",\"setter_rounds\":%llu,\"gets\":%llu,\"ok\":%s}\n",
+           static_cast<unsigned long long>(sets.load()), static_cast<unsigned long long>(gets.load()), failed ? "false" : "true");
+    return failed ? 1 : 0;
+}